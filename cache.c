@@ -0,0 +1,196 @@
+#include "cache.h"
+#include "ff.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+struct bcache *bcache_create(struct ffi *ffi, FILE *fp, uint64_t size) {
+	struct bcache *cache = calloc(1, sizeof(struct bcache));
+	cache->ffi			 = ffi;
+	cache->fp			 = fp;
+	cache->capacity		 = MAX(size / BCACHE_BLOCK_SIZE, 1);
+	cache->hash_size	 = 1;
+	while (cache->hash_size < cache->capacity)
+		cache->hash_size <<= 1;
+	cache->hash		= calloc(cache->hash_size, sizeof(struct bcache_block *));
+	cache->lru.prev = cache->lru.next = &cache->lru;
+	// 映射到内存的映像本身就在页缓存中，不需要再缓存一次
+	cache->passthrough = ffi->map != NULL;
+	cache->align	   = 1; // 挂载分区时按扇区大小增大
+	return cache;
+}
+
+static void lru_unlink(struct bcache_block *b) {
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+}
+
+static void lru_push(struct bcache *cache, struct bcache_block *b) {
+	b->prev				  = &cache->lru;
+	b->next				  = cache->lru.next;
+	cache->lru.next->prev = b;
+	cache->lru.next		  = b;
+}
+
+static struct bcache_block *bcache_lookup(struct bcache *cache, uint64_t blkno) {
+	struct bcache_block *b = cache->hash[blkno & (cache->hash_size - 1)];
+	while (b != NULL && b->blkno != blkno)
+		b = b->hnext;
+	return b;
+}
+
+// 块中的数据都是完整的，写回的范围扩展到整扇区，不会让映像所在的设备读-改-写
+static void bcache_writeback(struct bcache *cache, struct bcache_block *b) {
+	uint32_t start, end;
+
+	if (b->dirty_start == b->dirty_end) return;
+	start = b->dirty_start / cache->align * cache->align;
+	end	  = MIN((b->dirty_end + cache->align - 1) / cache->align * cache->align, BCACHE_BLOCK_SIZE);
+	cache->ffi->pwrite(cache->fp, b->data + start, end - start, b->blkno * BCACHE_BLOCK_SIZE + start);
+	b->dirty_start = b->dirty_end = 0;
+	cache->writebacks++;
+}
+
+static void bcache_remove(struct bcache *cache, struct bcache_block *b) {
+	struct bcache_block **p = &cache->hash[b->blkno & (cache->hash_size - 1)];
+	while (*p != b)
+		p = &(*p)->hnext;
+	*p = b->hnext;
+	lru_unlink(b);
+	free(b->data);
+	free(b);
+	cache->count--;
+}
+
+// 取得一个块并移到LRU链表头，fill为0时调用者会覆盖整块，不需要从映像读入
+static struct bcache_block *bcache_get(struct bcache *cache, uint64_t blkno, int fill) {
+	struct bcache_block *b = bcache_lookup(cache, blkno);
+
+	if (b != NULL) {
+		cache->hits++;
+		lru_unlink(b);
+		lru_push(cache, b);
+		return b;
+	}
+	cache->misses++;
+	if (cache->count >= cache->capacity) {
+		b = cache->lru.prev;
+		bcache_writeback(cache, b);
+		bcache_remove(cache, b);
+	}
+	b			   = malloc(sizeof(struct bcache_block));
+	b->data		   = malloc(BCACHE_BLOCK_SIZE);
+	b->blkno	   = blkno;
+	b->dirty_start = b->dirty_end = 0;
+	if (fill) cache->ffi->pread(cache->fp, b->data, BCACHE_BLOCK_SIZE, blkno * BCACHE_BLOCK_SIZE);
+	b->hnext									= cache->hash[blkno & (cache->hash_size - 1)];
+	cache->hash[blkno & (cache->hash_size - 1)] = b;
+	lru_push(cache, b);
+	cache->count++;
+	return b;
+}
+
+void bcache_read(struct bcache *cache, uint8_t *buffer, uint32_t size, uint64_t offset) {
+	struct bcache_block *b;
+	uint32_t off, n;
+
+	if (cache->passthrough) {
+		cache->ffi->pread(cache->fp, buffer, size, offset);
+		return;
+	}
+	while (size > 0) {
+		off = offset % BCACHE_BLOCK_SIZE;
+		n	= MIN(size, BCACHE_BLOCK_SIZE - off);
+		b	= bcache_get(cache, offset / BCACHE_BLOCK_SIZE, 1);
+		memcpy(buffer, b->data + off, n);
+		buffer += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+void bcache_write(struct bcache *cache, uint8_t *buffer, uint32_t size, uint64_t offset) {
+	struct bcache_block *b;
+	uint32_t off, n;
+
+	if (cache->passthrough) {
+		cache->ffi->pwrite(cache->fp, buffer, size, offset);
+		return;
+	}
+	while (size > 0) {
+		off = offset % BCACHE_BLOCK_SIZE;
+		n	= MIN(size, BCACHE_BLOCK_SIZE - off);
+		b	= bcache_get(cache, offset / BCACHE_BLOCK_SIZE, n < BCACHE_BLOCK_SIZE);
+		memcpy(b->data + off, buffer, n);
+		if (b->dirty_start == b->dirty_end) {
+			b->dirty_start = off;
+			b->dirty_end   = off + n;
+		} else {
+			b->dirty_start = MIN(b->dirty_start, off);
+			b->dirty_end   = MAX(b->dirty_end, off + n);
+		}
+		buffer += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+/**
+ * 绕过缓存直接读写映像前调用，写回并丢弃与该范围重叠的块
+ * 范围比缓存大时遍历缓存中的块，否则逐块查找
+ */
+void bcache_invalidate(struct bcache *cache, uint64_t offset, uint64_t size) {
+	struct bcache_block *b, *next;
+	uint64_t first, last, i;
+
+	if (cache->passthrough || size == 0 || cache->count == 0) return;
+	first = offset / BCACHE_BLOCK_SIZE;
+	last  = (offset + size - 1) / BCACHE_BLOCK_SIZE;
+	if (last - first + 1 > cache->count) {
+		for (b = cache->lru.next; b != &cache->lru; b = next) {
+			next = b->next;
+			if (b->blkno < first || b->blkno > last) continue;
+			bcache_writeback(cache, b);
+			bcache_remove(cache, b);
+		}
+	} else {
+		for (i = first; i <= last; i++) {
+			if ((b = bcache_lookup(cache, i)) == NULL) continue;
+			bcache_writeback(cache, b);
+			bcache_remove(cache, b);
+		}
+	}
+}
+
+static int bcache_cmp(const void *a, const void *b) {
+	uint64_t x = (*(struct bcache_block **)a)->blkno, y = (*(struct bcache_block **)b)->blkno;
+	return x < y ? -1 : x > y;
+}
+
+// 按在映像中的位置顺序写回所有脏块
+void bcache_flush(struct bcache *cache) {
+	struct bcache_block *b, **dirty;
+	uint32_t i, n = 0;
+
+	if (cache->count == 0) return;
+	dirty = malloc(cache->count * sizeof(struct bcache_block *));
+	for (b = cache->lru.next; b != &cache->lru; b = b->next) {
+		if (b->dirty_start != b->dirty_end) dirty[n++] = b;
+	}
+	qsort(dirty, n, sizeof(struct bcache_block *), bcache_cmp);
+	for (i = 0; i < n; i++)
+		bcache_writeback(cache, dirty[i]);
+	free(dirty);
+}
+
+void bcache_destroy(struct bcache *cache) {
+	bcache_flush(cache);
+	while (cache->lru.next != &cache->lru)
+		bcache_remove(cache, cache->lru.next);
+	free(cache->hash);
+	free(cache);
+}
\ No newline at end of file
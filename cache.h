@@ -0,0 +1,39 @@
+#pragma once
+
+#include "ff.h"
+#include <stdint.h>
+#include <stdio.h>
+
+#define BCACHE_BLOCK_SIZE	4096
+#define BCACHE_DEFAULT_SIZE (16 * 1024 * 1024) // 默认缓存大小
+
+struct bcache_block {
+	uint64_t blkno;
+	uint8_t *data;
+	uint32_t dirty_start, dirty_end; // 块内需要写回的范围，dirty_start == dirty_end时为干净块
+	struct bcache_block *prev, *next; // LRU链表，越靠前越近被使用
+	struct bcache_block *hnext;		  // 哈希链
+};
+
+/**
+ * 文件系统层和映像后端之间的块缓存，所有分区共用一个
+ * 以映像中的字节偏移寻址，内部按BCACHE_BLOCK_SIZE对齐读写
+ */
+struct bcache {
+	struct ffi *ffi;
+	FILE *fp;
+	uint32_t capacity, count; // 最多缓存的块数和当前块数
+	uint32_t hash_size;
+	struct bcache_block **hash;
+	struct bcache_block lru;
+	int passthrough; // 后端支持映射时不缓存，直接读写映像
+	uint32_t align;	 // 写回时对齐到的大小，为分区的最大扇区大小，避免写入不完整的扇区
+	uint64_t hits, misses, writebacks;
+};
+
+struct bcache *bcache_create(struct ffi *ffi, FILE *fp, uint64_t size);
+void bcache_read(struct bcache *cache, uint8_t *buffer, uint32_t size, uint64_t offset);
+void bcache_write(struct bcache *cache, uint8_t *buffer, uint32_t size, uint64_t offset);
+void bcache_invalidate(struct bcache *cache, uint64_t offset, uint64_t size);
+void bcache_flush(struct bcache *cache);
+void bcache_destroy(struct bcache *cache);
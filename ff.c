@@ -3,17 +3,36 @@
 #include <stdio.h>
 #include <string.h>
 
-struct ffi *ff_init(FILE *fp, char *filename) {
+/**
+ * 根据文件扩展名选择映像格式，backend用于选择raw格式映像的访问方式
+ * backend为NULL时使用默认的stdio方式
+ */
+struct ffi *ff_init(FILE *fp, char *filename, char *backend) {
 	struct ffi *ffi;
-	char *ext = filename;
-	while (*ext != '.')
-		ext++;
+	char *ext = strrchr(filename, '.');
+	if (ext == NULL) return NULL;
 	ext++;
 	if (strncmp(ext, "img", 3) == 0) {
-		ffi = &raw_ffi;
+		if (backend == NULL || strcmp(backend, "raw") == 0) {
+			ffi = &raw_ffi;
+#ifdef __linux__
+		} else if (strcmp(backend, "mmap") == 0) {
+			ffi = &mmap_ffi;
+		} else if (strcmp(backend, "uring") == 0) {
+			ffi = &uring_ffi;
+#endif
+		} else {
+			return NULL;
+		}
 	} else {
 		return NULL;
 	}
-	if (ffi->check(fp) != 0) { return NULL; }
+	if (ffi->check(fp) != 0) {
+		// 系统不支持所选的访问方式时使用默认方式
+		if (ffi == &raw_ffi || raw_ffi.check(fp) != 0) return NULL;
+		printf("Backend \"%s\" is unavailable, using raw.\n", backend);
+		ffi = &raw_ffi;
+	}
+	ffi->init(fp);
 	return ffi;
 }
\ No newline at end of file
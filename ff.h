@@ -9,9 +9,22 @@ struct ffi {
 	void (*init)(FILE *fp);
 	void (*read)(FILE *fp, uint8_t *buffer, uint32_t size);
 	void (*write)(FILE *fp, uint8_t *buffer, uint32_t size);
-	void (*seek)(FILE *fp, long offset, int origin);
+	void (*seek)(FILE *fp, int64_t offset, int origin);
+	// 在指定位置读写，不改变也不依赖当前的文件位置
+	void (*pread)(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset);
+	void (*pwrite)(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset);
+	void (*zero)(FILE *fp, uint64_t offset, uint64_t size); // 清零，支持时在映像文件中打洞
+	uint8_t *(*map)(FILE *fp, uint64_t offset, uint32_t size); // 可选，返回映像中对应位置的指针
+	// 可选，异步写入，返回后buffer即可重用，之后的pread/pwrite能看到写入的数据
+	void (*awrite)(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset);
+	void (*readahead)(FILE *fp, uint64_t offset, uint32_t size); // 可选，提示即将读取的范围
+	void (*exit)(FILE *fp);
 };
 
-struct ffi *ff_init(FILE *fp, char *filename);
+struct ffi *ff_init(FILE *fp, char *filename, char *backend);
 
-extern struct ffi raw_ffi;
\ No newline at end of file
+extern struct ffi raw_ffi;
+#ifdef __linux__
+extern struct ffi mmap_ffi;
+extern struct ffi uring_ffi;
+#endif
\ No newline at end of file
@@ -0,0 +1,118 @@
+#ifdef __linux__
+
+#define _GNU_SOURCE
+#include "../ff.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int mmap_check(FILE *fp);
+void mmap_init(FILE *fp);
+void mmap_read(FILE *fp, uint8_t *buffer, uint32_t size);
+void mmap_write(FILE *fp, uint8_t *buffer, uint32_t size);
+void mmap_seek(FILE *fp, int64_t offset, int origin);
+void mmap_pread(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset);
+void mmap_pwrite(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset);
+void mmap_zero(FILE *fp, uint64_t offset, uint64_t size);
+uint8_t *mmap_map(FILE *fp, uint64_t offset, uint32_t size);
+void mmap_exit(FILE *fp);
+
+struct ffi mmap_ffi = {
+	.check	= &mmap_check,
+	.init	= &mmap_init,
+	.read	= &mmap_read,
+	.write	= &mmap_write,
+	.seek	= &mmap_seek,
+	.pread	= &mmap_pread,
+	.pwrite = &mmap_pwrite,
+	.zero	= &mmap_zero,
+	.map	= &mmap_map,
+	.exit	= &mmap_exit,
+};
+
+// 整个映像映射到内存，读写都变成内存复制
+static struct {
+	uint8_t *base;
+	uint64_t size;
+	int64_t pos;
+} image;
+
+int mmap_check(FILE *fp) {
+	struct stat st;
+	if (fstat(fileno(fp), &st) != 0 || st.st_size == 0) return -1;
+	image.base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+	if (image.base == MAP_FAILED) {
+		image.base = NULL;
+		return -1;
+	}
+	image.size = st.st_size;
+	image.pos  = 0;
+	return 0;
+}
+
+void mmap_init(FILE *fp) {
+	madvise(image.base, image.size, MADV_WILLNEED);
+	return;
+}
+
+void mmap_read(FILE *fp, uint8_t *buffer, uint32_t size) {
+	mmap_pread(fp, buffer, size, image.pos);
+	image.pos += size;
+	return;
+}
+
+void mmap_write(FILE *fp, uint8_t *buffer, uint32_t size) {
+	mmap_pwrite(fp, buffer, size, image.pos);
+	image.pos += size;
+	return;
+}
+
+void mmap_pread(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset) {
+	uint64_t n = offset >= image.size ? 0 : image.size - offset;
+	if (n > size) n = size;
+	memcpy(buffer, image.base + offset, n);
+	memset(buffer + n, 0, size - n);
+	return;
+}
+
+void mmap_pwrite(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset) {
+	uint64_t n = offset >= image.size ? 0 : image.size - offset;
+	if (n > size) n = size;
+	memmove(image.base + offset, buffer, n); // buffer可能就是映射中的同一块内存
+	return;
+}
+
+void mmap_seek(FILE *fp, int64_t offset, int origin) {
+	if (origin == SEEK_SET) {
+		image.pos = offset;
+	} else if (origin == SEEK_CUR) {
+		image.pos += offset;
+	} else if (origin == SEEK_END) {
+		image.pos = image.size + offset;
+	}
+	return;
+}
+
+// 映射是共享的，在文件中打洞后映射中的内容也变成0，不支持时直接清零
+void mmap_zero(FILE *fp, uint64_t offset, uint64_t size) {
+	if (offset >= image.size) return;
+	if (size > image.size - offset) size = image.size - offset;
+	if (fallocate(fileno(fp), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) return;
+	memset(image.base + offset, 0, size);
+}
+
+uint8_t *mmap_map(FILE *fp, uint64_t offset, uint32_t size) {
+	if (offset + size > image.size) return NULL;
+	return image.base + offset;
+}
+
+void mmap_exit(FILE *fp) {
+	msync(image.base, image.size, MS_SYNC);
+	munmap(image.base, image.size);
+	image.base = NULL;
+	return;
+}
+
+#endif
\ No newline at end of file
@@ -1,17 +1,34 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <fcntl.h>
+#endif
 #include "../ff.h"
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 int raw_check(FILE *fp);
 void raw_init(FILE *fp);
 void raw_read(FILE *fp, uint8_t *buffer, uint32_t size);
 void raw_write(FILE *fp, uint8_t *buffer, uint32_t size);
-void raw_seek(FILE *fp, long offset, int origin);
+void raw_seek(FILE *fp, int64_t offset, int origin);
+void raw_pread(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset);
+void raw_pwrite(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset);
+void raw_zero(FILE *fp, uint64_t offset, uint64_t size);
+void raw_exit(FILE *fp);
 
 struct ffi raw_ffi = {
-	.check = &raw_check,
-	.init  = &raw_init,
-	.read  = &raw_read,
-	.write = &raw_write,
-	.seek  = &raw_seek,
+	.check	= &raw_check,
+	.init	= &raw_init,
+	.read	= &raw_read,
+	.write	= &raw_write,
+	.seek	= &raw_seek,
+	.pread	= &raw_pread,
+	.pwrite = &raw_pwrite,
+	.zero	= &raw_zero,
+	.map	= NULL,
+	.exit	= &raw_exit,
 };
 
 int raw_check(FILE *fp) {
@@ -32,7 +49,79 @@ void raw_write(FILE *fp, uint8_t *buffer, uint32_t size) {
 	return;
 }
 
-void raw_seek(FILE *fp, long offset, int origin) {
-	fseek(fp, offset, origin);
+// long在Windows上只有32位，超过2GB的位置要用64位的接口
+void raw_seek(FILE *fp, int64_t offset, int origin) {
+#ifdef _WIN32
+	_fseeki64(fp, offset, origin);
+#else
+	fseeko(fp, offset, origin);
+#endif
+	return;
+}
+
+#ifdef _WIN32
+
+void raw_pread(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset) {
+	_fseeki64(fp, offset, SEEK_SET);
+	fread(buffer, size, 1, fp);
+}
+
+void raw_pwrite(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset) {
+	_fseeki64(fp, offset, SEEK_SET);
+	fwrite(buffer, size, 1, fp);
+}
+
+#else
+
+// 直接在文件描述符上读写，可以被多个线程同时调用
+void raw_pread(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset) {
+	ssize_t n;
+	while (size > 0) {
+		n = pread(fileno(fp), buffer, size, offset);
+		if (n <= 0) {
+			memset(buffer, 0, size); // 超出文件末尾的部分视为0
+			return;
+		}
+		buffer += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+void raw_pwrite(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset) {
+	ssize_t n;
+	while (size > 0) {
+		n = pwrite(fileno(fp), buffer, size, offset);
+		if (n <= 0) {
+			perror("imgtool");
+			return;
+		}
+		buffer += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+#endif
+
+// 支持时在映像文件中打洞，读出来是0且不占用空间，否则写入0
+void raw_zero(FILE *fp, uint64_t offset, uint64_t size) {
+	uint8_t buf[4096];
+	uint32_t n;
+
+#ifdef __linux__
+	if (fallocate(fileno(fp), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) return;
+#endif
+	memset(buf, 0, sizeof(buf));
+	while (size > 0) {
+		n = size < sizeof(buf) ? size : sizeof(buf);
+		raw_pwrite(fp, buf, n, offset);
+		offset += n;
+		size -= n;
+	}
+}
+
+void raw_exit(FILE *fp) {
+	fflush(fp);
 	return;
 }
\ No newline at end of file
@@ -0,0 +1,333 @@
+#ifdef __linux__
+
+#define _GNU_SOURCE
+#include "../ff.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_DEPTH 32			  // 最多同时提交的请求数
+#define URING_CHUNK (1024 * 1024) // 异步写入时每个请求的最大长度
+
+int uring_check(FILE *fp);
+void uring_init(FILE *fp);
+void uring_pread(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset);
+void uring_pwrite(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset);
+void uring_awrite(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset);
+void uring_zero(FILE *fp, uint64_t offset, uint64_t size);
+void uring_readahead(FILE *fp, uint64_t offset, uint32_t size);
+void uring_exit(FILE *fp);
+
+void raw_read(FILE *fp, uint8_t *buffer, uint32_t size);
+void raw_write(FILE *fp, uint8_t *buffer, uint32_t size);
+void raw_seek(FILE *fp, int64_t offset, int origin);
+void raw_zero(FILE *fp, uint64_t offset, uint64_t size);
+
+struct ffi uring_ffi = {
+	.check	   = &uring_check,
+	.init	   = &uring_init,
+	.read	   = &raw_read,
+	.write	   = &raw_write,
+	.seek	   = &raw_seek,
+	.pread	   = &uring_pread,
+	.pwrite	   = &uring_pwrite,
+	.zero	   = &uring_zero,
+	.map	   = NULL,
+	.awrite	   = &uring_awrite,
+	.readahead = &uring_readahead,
+	.exit	   = &uring_exit,
+};
+
+// 一个已提交还未完成的请求，写请求的数据复制在buf中，调用者的缓冲区可以立即重用
+struct uring_req {
+	uint8_t *buf;
+	uint64_t offset;
+	uint32_t size;
+	int busy, write;
+};
+
+static struct {
+	int ring_fd, fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+	struct uring_req req[URING_DEPTH];
+	uint32_t inflight, queued; // 已提交和已放入队列还未提交的请求数
+	pthread_mutex_t lock;
+} ring;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// 内核是否支持IORING_OP_WRITE，5.6之前的内核既没有这个操作也不能探测
+static int uring_probe_write(void) {
+	struct io_uring_probe *probe;
+	int ok;
+
+	probe = calloc(1, sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+	if (probe == NULL) return 0;
+	ok = sys_io_uring_register(ring.ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 &&
+		 probe->last_op >= IORING_OP_WRITE && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+int uring_check(FILE *fp) {
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	ring.fd		 = fileno(fp);
+	ring.ring_fd = sys_io_uring_setup(URING_DEPTH, &p);
+	if (ring.ring_fd < 0) return -1;
+	if (!uring_probe_write()) {
+		close(ring.ring_fd);
+		return -1;
+	}
+
+	ring.sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_size   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.ring_fd,
+					   IORING_OFF_SQ_RING);
+	ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.ring_fd,
+					   IORING_OFF_CQ_RING);
+	ring.sqes	= mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.ring_fd,
+					   IORING_OFF_SQES);
+	if (ring.sq_ptr == MAP_FAILED || ring.cq_ptr == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		if (ring.sq_ptr != MAP_FAILED) munmap(ring.sq_ptr, ring.sq_size);
+		if (ring.cq_ptr != MAP_FAILED) munmap(ring.cq_ptr, ring.cq_size);
+		if (ring.sqes != MAP_FAILED) munmap(ring.sqes, ring.sqes_size);
+		close(ring.ring_fd);
+		return -1;
+	}
+	ring.sq_head  = (void *)((uint8_t *)ring.sq_ptr + p.sq_off.head);
+	ring.sq_tail  = (void *)((uint8_t *)ring.sq_ptr + p.sq_off.tail);
+	ring.sq_mask  = (void *)((uint8_t *)ring.sq_ptr + p.sq_off.ring_mask);
+	ring.sq_array = (void *)((uint8_t *)ring.sq_ptr + p.sq_off.array);
+	ring.cq_head  = (void *)((uint8_t *)ring.cq_ptr + p.cq_off.head);
+	ring.cq_tail  = (void *)((uint8_t *)ring.cq_ptr + p.cq_off.tail);
+	ring.cq_mask  = (void *)((uint8_t *)ring.cq_ptr + p.cq_off.ring_mask);
+	ring.cqes	  = (void *)((uint8_t *)ring.cq_ptr + p.cq_off.cqes);
+	return 0;
+}
+
+void uring_init(FILE *fp) {
+	fflush(fp);
+	pthread_mutex_init(&ring.lock, NULL);
+	ring.inflight = ring.queued = 0;
+}
+
+// 取出所有已完成的请求，写入不完整或失败时同步写完剩下的部分，数据不会丢失
+static void uring_reap(void) {
+	struct io_uring_cqe *cqe;
+	struct uring_req *req;
+	unsigned head = *ring.cq_head;
+	uint32_t done;
+	ssize_t n;
+
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		req = &ring.req[cqe->user_data];
+		if (req->write) {
+			done = cqe->res < 0 ? 0 : cqe->res;
+			while (done < req->size) {
+				n = pwrite(ring.fd, req->buf + done, req->size - done, req->offset + done);
+				if (n <= 0) {
+					perror("imgtool");
+					break;
+				}
+				done += n;
+			}
+		}
+		req->busy = 0;
+		ring.inflight--;
+		head++;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+// 提交队列中的请求，wait个请求完成后返回
+static void uring_submit(unsigned wait) {
+	int ret;
+
+	while (ring.queued > 0 || wait > 0) {
+		ret = sys_io_uring_enter(ring.ring_fd, ring.queued, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			perror("imgtool");
+			return;
+		}
+		ring.inflight += ret;
+		ring.queued -= ret;
+		uring_reap();
+		if (wait > 0) wait = 0;
+	}
+}
+
+// 取得一个空闲的请求和提交队列项，队列满时先等待至少一个请求完成
+static struct io_uring_sqe *uring_get_sqe(struct uring_req **req) {
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+	int i;
+
+	for (;;) {
+		for (i = 0; i < URING_DEPTH && ring.req[i].busy; i++)
+			;
+		if (i < URING_DEPTH) break;
+		uring_submit(1);
+	}
+	*req		 = &ring.req[i];
+	(*req)->busy = 1;
+	tail		 = *ring.sq_tail;
+	sqe			 = &ring.sqes[tail & *ring.sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->user_data						= i;
+	ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.queued++;
+	return sqe;
+}
+
+// 与未完成的写请求重叠时等待所有请求完成，保证之后的同步读写看到正确的数据
+static void uring_wait_overlap(uint64_t offset, uint64_t size) {
+	int i;
+
+	for (i = 0; i < URING_DEPTH; i++) {
+		if (ring.req[i].busy && ring.req[i].write && ring.req[i].offset < offset + size &&
+			offset < ring.req[i].offset + ring.req[i].size)
+			break;
+	}
+	if (i == URING_DEPTH) return;
+	while (ring.queued > 0 || ring.inflight > 0)
+		uring_submit(ring.inflight + ring.queued);
+}
+
+void uring_pread(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset) {
+	ssize_t n;
+
+	pthread_mutex_lock(&ring.lock);
+	uring_wait_overlap(offset, size);
+	pthread_mutex_unlock(&ring.lock);
+	while (size > 0) {
+		n = pread(ring.fd, buffer, size, offset);
+		if (n <= 0) {
+			memset(buffer, 0, size); // 超出文件末尾的部分视为0
+			return;
+		}
+		buffer += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+void uring_pwrite(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset) {
+	ssize_t n;
+
+	pthread_mutex_lock(&ring.lock);
+	uring_wait_overlap(offset, size);
+	pthread_mutex_unlock(&ring.lock);
+	while (size > 0) {
+		n = pwrite(ring.fd, buffer, size, offset);
+		if (n <= 0) {
+			perror("imgtool");
+			return;
+		}
+		buffer += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+void uring_zero(FILE *fp, uint64_t offset, uint64_t size) {
+	pthread_mutex_lock(&ring.lock);
+	uring_wait_overlap(offset, size);
+	pthread_mutex_unlock(&ring.lock);
+	raw_zero(fp, offset, size);
+}
+
+/**
+ * 把数据按URING_CHUNK切分成多个写请求放入队列，一次系统调用全部提交
+ * 不等待写入完成，已提交的请求在队列满、读写重叠或退出时回收
+ */
+void uring_awrite(FILE *fp, uint8_t *buffer, uint32_t size, uint64_t offset) {
+	struct io_uring_sqe *sqe;
+	struct uring_req *req;
+	uint32_t n;
+
+	pthread_mutex_lock(&ring.lock);
+	uring_wait_overlap(offset, size);
+	while (size > 0) {
+		n	= size < URING_CHUNK ? size : URING_CHUNK;
+		sqe = uring_get_sqe(&req);
+		if (req->buf == NULL) req->buf = malloc(URING_CHUNK);
+		memcpy(req->buf, buffer, n);
+		req->offset	 = offset;
+		req->size	 = n;
+		req->write	 = 1;
+		sqe->opcode	 = IORING_OP_WRITE;
+		sqe->fd		 = ring.fd;
+		sqe->addr	 = (uint64_t)(uintptr_t)req->buf;
+		sqe->len	 = n;
+		sqe->off	 = offset;
+		buffer += n;
+		offset += n;
+		size -= n;
+	}
+	uring_submit(0);
+	pthread_mutex_unlock(&ring.lock);
+}
+
+// 提示内核预读映像中的一段数据，不占用缓冲区
+void uring_readahead(FILE *fp, uint64_t offset, uint32_t size) {
+	struct io_uring_sqe *sqe;
+	struct uring_req *req;
+
+	pthread_mutex_lock(&ring.lock);
+	sqe					= uring_get_sqe(&req);
+	req->write			= 0;
+	sqe->opcode			= IORING_OP_FADVISE;
+	sqe->fd				= ring.fd;
+	sqe->off			= offset;
+	sqe->len			= size;
+	sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+	uring_submit(0);
+	pthread_mutex_unlock(&ring.lock);
+}
+
+void uring_exit(FILE *fp) {
+	int i;
+
+	pthread_mutex_lock(&ring.lock);
+	while (ring.queued > 0 || ring.inflight > 0)
+		uring_submit(ring.inflight + ring.queued);
+	pthread_mutex_unlock(&ring.lock);
+	for (i = 0; i < URING_DEPTH; i++) {
+		free(ring.req[i].buf);
+		ring.req[i].buf = NULL;
+	}
+	munmap(ring.sqes, ring.sqes_size);
+	munmap(ring.cq_ptr, ring.cq_size);
+	munmap(ring.sq_ptr, ring.sq_size);
+	close(ring.ring_fd);
+	pthread_mutex_destroy(&ring.lock);
+}
+
+#endif
\ No newline at end of file
@@ -19,14 +19,27 @@ struct fsi fat32_fsi = {
 	.open			 = &FAT32_open,
 	.opendir		 = &FAT32_open_dir,
 	.close			 = &FAT32_close,
+	.flush			 = &FAT32_flush,
 	.seek			 = &FAT32_seek,
 	.read			 = &FAT32_read,
 	.write			 = &FAT32_write,
+	.prealloc		 = &FAT32_prealloc,
+	.truncate		 = &FAT32_truncate,
 	.createfile		 = &FAT32_create_file,
 	.delete			 = &FAT32_delete_file,
 	.mkdir			 = &FAT32_mkdir,
 	.get_attr		 = &FAT32_get_attr,
 	.set_attr		 = &FAT32_set_attr,
+	.diropen		 = &FAT32_diropen,
+	.readdir		 = &FAT32_readdir,
+	.dirclose		 = &FAT32_dirclose,
+	.stat			 = &FAT32_stat,
+	.clamp_time		 = &FAT32_clamp_time,
+	.get_runs		 = &FAT32_get_runs,
+	.umount			 = &FAT32_umount,
+	.mkfs			 = &fat32_mkfs,
+	.fsck			 = &fat32_fsck,
+	.defrag			 = &fat32_defrag,
 };
 
 int fat32_check(struct ffi *ffi, FILE *fp, struct partition *pt) {
@@ -34,23 +47,54 @@ int fat32_check(struct ffi *ffi, FILE *fp, struct partition *pt) {
 	return -1;
 }
 
+/**
+ * 分区表中的起始扇区以磁盘的扇区为单位，4Kn映像上是4096字节
+ * 依次假定512到4096字节的扇区大小读取引导扇区，BPB中的扇区大小与假定的相同时返回它，都不符合时返回0
+ */
+static uint32_t fat32_probe_sector(struct ffi *ffi, FILE *fp, uint64_t start, struct pt_fat32 *fat32,
+								   uint8_t *data) {
+	uint32_t size;
+
+	for (size = SECTOR_SIZE; size <= FAT32_MAX_SECTOR; size <<= 1) {
+		memset(data, 0, size);
+		ffi->pread(fp, data, size, start * size);
+		memcpy(fat32, data, FAT32_BOOT_SIZE);
+		if (fat32->Signature == 0xaa55 && fat32->BPB_BytesPerSec == size) return size;
+	}
+	return 0;
+}
+
 int fat32_readsuperblock(struct ffi *ffi, FILE *fp, struct _partition_s *partition) {
 	struct fnode *fnode;
-	uint8_t *data		   = malloc(SECTOR_SIZE);
+	uint8_t *data		   = malloc(FAT32_MAX_SECTOR);
 	struct pt_fat32 *fat32 = malloc(sizeof(struct pt_fat32));
-	ffi->seek(fp, partition->start * SECTOR_SIZE, SEEK_SET);
-	ffi->read(fp, data, SECTOR_SIZE);
-	memcpy(fat32, data, SECTOR_SIZE);
-	ffi->read(fp, (uint8_t *)&fat32->FSInfo, SECTOR_SIZE);
+
+	// 引导扇区和FSInfo都整扇区读入，4Kn映像上的读写也按4KB对齐
+	partition->sector_size = fat32_probe_sector(ffi, fp, partition->start, fat32, data);
+	if (partition->sector_size == 0) {
+		free(data);
+		free(fat32);
+		return -1;
+	}
+	ffi->pread(fp, data, partition->sector_size, FAT32_SECTOR_OFFSET(fat32, partition->start + fat32->BPB_FSInfo));
+	memcpy(&fat32->FSInfo, data, sizeof(struct FS_Info));
 	free(data);
+	if (partition->cache->align < partition->sector_size) partition->cache->align = partition->sector_size;
 
 	if (fat32->FSInfo.FSI_LeadSig == 0x41615252) {
 		fat32->fat_start		= partition->start + fat32->BPB_RevdSecCnt;
 		partition->private_data = fat32;
 		fat32->data_start		= fat32->fat_start + fat32->BPB_NumFATs * fat32->BPB_FATSz32;
+		if (fat32_load_fat(ffi, fp, partition) != 0) {
+			partition->private_data = NULL;
+			free(fat32);
+			return -1;
+		}
+		fat32->dir_index = calloc(FAT32_INDEX_SLOTS, sizeof(struct fat32_dir_index *));
+		fat32->bounce	 = malloc(FAT32_WRITE_BOUNCE);
 		struct FAT32_dir sdir;
-		ffi->seek(fp, fat32->data_start * SECTOR_SIZE, SEEK_SET);
-		ffi->read(fp, (uint8_t *)&sdir, sizeof(struct FAT32_dir));
+		bcache_read(partition->cache, (uint8_t *)&sdir, sizeof(struct FAT32_dir),
+					FAT32_CLUS_OFFSET(fat32, fat32->BPB_RootClus));
 		if (sdir.DIR_Attr == FAT32_ATTR_VOLUME_ID) {
 			int cnt = 1;
 			while (sdir.DIR_Name[cnt] != ' ' && cnt < 11)
@@ -58,13 +102,13 @@ int fat32_readsuperblock(struct ffi *ffi, FILE *fp, struct _partition_s *partiti
 			partition->name = malloc(cnt);
 			strncpy(partition->name, (char *)sdir.DIR_Name, cnt);
 		}
-		fnode			= malloc(sizeof(struct fnode));
+		fnode			= calloc(1, sizeof(struct fnode));
 		fnode->name		= malloc(sizeof(2));
 		fnode->name[0]	= '/';
 		fnode->name[1]	= 0;
 		fnode->parent	= NULL;
 		fnode->part		= partition;
-		fnode->pos		= 2;
+		fnode->pos		= fat32->BPB_RootClus;
 		fnode->offset	= 0;
 		partition->root = fnode;
 		return 0;
@@ -73,7 +117,7 @@ int fat32_readsuperblock(struct ffi *ffi, FILE *fp, struct _partition_s *partiti
 	return -1;
 }
 
-void FAT32_seek(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint32_t offset, int fromwhere) {
+void FAT32_seek(struct ffi *ffi, FILE *fp, struct fnode *fnode, int64_t offset, int fromwhere) {
 	if (fromwhere == SEEK_SET) {
 		fnode->offset = offset;
 	} else if (fromwhere == SEEK_CUR) {
@@ -86,792 +130,1290 @@ void FAT32_seek(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint32_t offset,
 	return;
 }
 
+/**
+ * 从文件当前位置读取，最多读到文件末尾，读完后移动文件位置
+ * 先建立整个范围的簇区间表，每个连续的簇区间用一次pread读入，跨簇读取不需要拆分
+ */
 void FAT32_read(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint8_t *buffer, uint32_t length) {
 	struct pt_fat32 *fat32 = fs_FAT32(fnode->part->private_data);
-	int cnt				   = fnode->offset / (SECTOR_SIZE * fat32->BPB_SecPerClus);
-	int pos;
-	pos = fat_next(ffi, fp, fnode->part, fnode->pos, cnt, 0);
-	ffi->seek(fp,
-			  fnode->offset % (SECTOR_SIZE * fat32->BPB_SecPerClus) +
-				  (fat32->data_start + (pos - 2) * fat32->BPB_SecPerClus) * SECTOR_SIZE,
-			  SEEK_SET);
-	ffi->read(fp, buffer, length);
+	uint32_t clus_size	   = FAT32_CLUS_SIZE(fat32);
+	uint32_t pos, run, off, n, done = 0;
+	uint64_t addr;
+
+	if (fnode->offset >= fnode->size) return;
+	length = MIN(length, fnode->size - fnode->offset);
+	fat32_map(ffi, fp, fnode, (fnode->offset + length - 1) / clus_size, 0, NULL); // 一次建立整个范围的簇区间
+	while (done < length) {
+		pos = fat32_map(ffi, fp, fnode, (fnode->offset + done) / clus_size, 0, &run);
+		if (pos == 0) break;
+		off	 = (fnode->offset + done) % clus_size;
+		n	 = MIN(length - done, run * clus_size - off);
+		addr = FAT32_CLUS_OFFSET(fat32, pos) + off;
+		bcache_invalidate(fnode->part->cache, addr, n);
+		ffi->pread(fp, buffer + done, n, addr);
+		done += n;
+	}
+	fnode->offset += done;
+}
+
+static void fat32_write_sectors(struct ffi *ffi, FILE *fp, uint8_t *buffer, uint32_t size, uint64_t addr) {
+	if (ffi->awrite != NULL) ffi->awrite(fp, buffer, size, addr);
+	else ffi->pwrite(fp, buffer, size, addr);
+}
+
+/**
+ * 把n字节文件数据写入映像中的addr处，所有写入都是整扇区的，4Kn映像上不会产生不足4KB的写入
+ * 开头和结尾不足一扇区的部分合并成整扇区写入，扇区中其余的数据从映像读入，
+ * eof为1时写入的结尾就是文件末尾，扇区中之后的部分补0而不读取
+ */
+static void fat32_write_data(struct ffi *ffi, FILE *fp, struct pt_fat32 *fat32, uint8_t *buffer, uint32_t n,
+							 uint64_t addr, int eof) {
+	uint32_t sec = fat32->BPB_BytesPerSec, head = addr % sec, len;
+	uint8_t sector[FAT32_MAX_SECTOR];
+
+	if (head != 0 || n < sec) {
+		len = MIN(n, sec - head);
+		if (head != 0 || !eof || len < n) ffi->pread(fp, sector, sec, addr - head);
+		if (eof && len == n) memset(sector + head + len, 0, sec - head - len);
+		memcpy(sector + head, buffer, len);
+		fat32_write_sectors(ffi, fp, sector, sec, addr - head);
+		buffer += len;
+		addr += len;
+		n -= len;
+	}
+	// 小文件的数据和补0的最后一个扇区复制到一起一次写入，少一次写请求
+	if (eof && n % sec != 0 && n <= FAT32_WRITE_BOUNCE) {
+		len = DIV_ROUND_UP(n, sec) * sec;
+		memcpy(fat32->bounce, buffer, n);
+		memset(fat32->bounce + n, 0, len - n);
+		fat32_write_sectors(ffi, fp, fat32->bounce, len, addr);
+		return;
+	}
+	len = n - n % sec;
+	if (len > 0) fat32_write_sectors(ffi, fp, buffer, len, addr);
+	if (n % sec == 0) return;
+	if (eof) memset(sector, 0, sec);
+	else ffi->pread(fp, sector, sec, addr + len);
+	memcpy(sector, buffer + len, n % sec);
+	fat32_write_sectors(ffi, fp, sector, sec, addr + len);
 }
 
 void FAT32_write(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint8_t *buffer, uint32_t length) {
-	int i;
-	int pos, tmp;
-	uint8_t buf[SECTOR_SIZE];
+	uint32_t pos, run, off, n, done = 0;
 	struct pt_fat32 *fat32 = fnode->part->private_data;
-	struct FAT32_dir *sdir;
-	int cnt	 = DIV_ROUND_UP(fnode->offset, (SECTOR_SIZE * fat32->BPB_SecPerClus));
-	int off	 = fnode->offset % SECTOR_SIZE;
-	int off2 = fnode->offset % (SECTOR_SIZE * fat32->BPB_SecPerClus);
-	time_t timep;
+	uint32_t clus_size	   = FAT32_CLUS_SIZE(fat32);
+	uint64_t addr;
+
+	// 超过FAT32文件大小上限的部分不写入
+	if (fnode->offset >= FAT32_MAX_FILE_SIZE) return;
+	length = MIN(length, FAT32_MAX_FILE_SIZE - fnode->offset);
+	// 先分配好整个范围需要的簇，再按连续的簇区间整段写入，后端支持时异步写入
+	if (length > 0) fat32_map(ffi, fp, fnode, (fnode->offset + length - 1) / clus_size, FAT32_ALLOC_DATA, NULL);
+	while (done < length) {
+		pos = fat32_map(ffi, fp, fnode, (fnode->offset + done) / clus_size, 0, &run);
+		if (pos == 0) break; // 分区已满
+		off	 = (fnode->offset + done) % clus_size;
+		n	 = MIN(length - done, run * clus_size - off);
+		addr = FAT32_CLUS_OFFSET(fat32, pos) + off;
+		bcache_invalidate(fnode->part->cache, addr, n);
+		fat32_write_data(ffi, fp, fat32, buffer + done, n, addr, fnode->offset + done + n >= fnode->size);
+		done += n;
+	}
+
+	// 目录项只在flush或close时写回
+	fnode->offset += done;
+	if (fnode->offset > fnode->size) fnode->size = fnode->offset;
+	time(&fnode->mtime);
+	fnode->dirty = 1;
+}
+
+// 把文件大小和修改时间写回目录项
+void FAT32_flush(struct ffi *ffi, FILE *fp, struct fnode *fnode) {
+	struct FAT32_dir sdir;
 	struct tm *p;
-	time(&timep);
-	p = gmtime(&timep);
+	uint64_t pos;
 
-	pos = fat_next(ffi, fp, fnode->part, fnode->pos, cnt, 1);
+	if (!fnode->dirty || fnode->parent == NULL) return;
+	pos = fat32_dirent_pos(ffi, fp, fnode->parent, fnode->dir_offset);
+	if (pos == 0) return;
+	bcache_read(fnode->part->cache, (uint8_t *)&sdir, sizeof(struct FAT32_dir), pos);
+	fnode->mtime		 = FAT32_clamp_time(fnode->mtime);
+	p					 = gmtime(&fnode->mtime);
+	sdir.DIR_FileSize	 = fnode->size;
+	sdir.DIR_LastAccDate = sdir.DIR_WrtDate = FAT32_DATE(p);
+	sdir.DIR_WrtTime						= FAT32_TIME(p);
+	bcache_write(fnode->part->cache, (uint8_t *)&sdir, sizeof(struct FAT32_dir), pos);
+	fnode->dirty = 0;
+}
 
-	ffi->seek(fp, off2 + ((pos - 2) * fat32->BPB_SecPerClus + fat32->data_start) * SECTOR_SIZE, SEEK_SET);
-	ffi->write(fp, buffer, MIN(SECTOR_SIZE - off, off + length));
-	if (fnode->offset % SECTOR_SIZE + length <= SECTOR_SIZE) goto done; // 只写一个扇区时写完退出
-	else {
-		length -= SECTOR_SIZE - off;
-		pos = fat_next(ffi, fp, fnode->part, fnode->pos, cnt, 1);
+// 只保留文件簇链的前keep个簇，last是其中最后一个簇，之后的簇都释放，簇区间表也截断
+static void fat32_trim_chain(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint32_t keep, uint32_t last) {
+	uint32_t pos, next;
+	struct extent *ext;
+
+	if (last != 0) {
+		pos = find_member_in_fat(ffi, fp, fnode->part, last);
+		fat32_set_member(fnode->part, last, 0x0fffffff);
+		while (pos >= 2 && pos < 0x0ffffff8) {
+			next = find_member_in_fat(ffi, fp, fnode->part, pos);
+			fat32_set_member(fnode->part, pos, 0);
+			pos = next;
+		}
 	}
+	while (fnode->extent_cnt > 1 && fnode->extents[fnode->extent_cnt - 1].lclus >= keep)
+		fnode->extent_cnt--;
+	if (fnode->extent_cnt > 0) {
+		ext = &fnode->extents[fnode->extent_cnt - 1];
+		if (ext->lclus + ext->len > keep) ext->len = keep - ext->lclus;
+	}
+}
 
-	i = 0;
-	while (length > 0) {
-		if (i % fat32->BPB_SecPerClus == 0 && i != 0) {
-			pos = fat_next(ffi, fp, fnode->part, pos, 1, 1);
-			if (pos == 0) return;
+/**
+ * 预先为文件分配足够容纳size字节的簇链，尽量分配连续的簇
+ * 只会增长簇链，不改变文件大小，空间不足或超过FAT32的文件大小上限时返回-1，
+ * 这时已经分配的簇都释放，簇链恢复原来的长度
+ */
+int FAT32_prealloc(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint64_t size) {
+	struct pt_fat32 *fat32 = fnode->part->private_data;
+	uint32_t clus_size	   = FAT32_CLUS_SIZE(fat32);
+	uint32_t need, have = 0, old, run, last, got;
+
+	if (fnode->pos < 2 || size > FAT32_MAX_FILE_SIZE) return -1;
+	need = MAX(DIV_ROUND_UP(size, clus_size), 1);
+	// 先统计已有的簇数
+	while (have < need && fat32_map(ffi, fp, fnode, have, 0, &run) != 0)
+		have += run;
+	old = have;
+	while (have < need) {
+		last = fat32_map(ffi, fp, fnode, have - 1, 0, NULL);
+		if (fat32_alloc_run(fnode->part, last, need - have, &got) == 0) {
+			fat32_trim_chain(ffi, fp, fnode, old, fat32_map(ffi, fp, fnode, old - 1, 0, NULL));
+			return -1;
 		}
-		ffi->seek(fp, (i % 2 + (pos - 2) * fat32->BPB_SecPerClus + fat32->data_start) * SECTOR_SIZE,
-				  SEEK_SET);
-		ffi->write(fp, buffer, MIN(length, SECTOR_SIZE));
-		length -= MIN(length, SECTOR_SIZE);
+		have += got;
 	}
+	return 0;
+}
 
-done:
-	pos = fat_next(ffi, fp, fnode->part, fnode->parent->pos,
-				   fnode->dir_offset / (SECTOR_SIZE * fat32->BPB_SecPerClus), 0);
-	if (pos == 0) return;
-	ffi->seek(fp, (fat32->data_start + (pos - 2) * fat32->BPB_SecPerClus) * SECTOR_SIZE, SEEK_SET);
-	ffi->read(fp, (uint8_t *)buf, SECTOR_SIZE);
-	sdir = (struct FAT32_dir *)(buf + fnode->dir_offset % SECTOR_SIZE);
-	if (fnode->offset + length > fnode->size) // 超出文件大小
-	{
-		sdir->DIR_FileSize = fnode->offset + length;
-		fnode->size		   = fnode->offset + length;
+/**
+ * 把文件缩短到size字节，释放多余的簇，至少保留第一个簇
+ * size等于文件大小时只释放预分配后没有用到的簇，最后一个簇中size之后的部分在close时清零
+ */
+void FAT32_truncate(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint64_t size) {
+	struct pt_fat32 *fat32 = fnode->part->private_data;
+	uint32_t clus_size	   = FAT32_CLUS_SIZE(fat32);
+	uint32_t keep		   = MAX(DIV_ROUND_UP(size, clus_size), 1);
+	uint32_t sec		   = fat32->BPB_BytesPerSec;
+	uint32_t last, pos, head;
+	uint8_t sector[FAT32_MAX_SECTOR];
+	uint64_t addr;
+
+	if (size > fnode->size) return;
+	last = fat32_map(ffi, fp, fnode, keep - 1, 0, NULL);
+	pos	 = last != 0 ? find_member_in_fat(ffi, fp, fnode->part, last) : 0;
+	if (size == fnode->size && (pos < 2 || pos >= 0x0ffffff8)) return;
+	fat32_trim_chain(ffi, fp, fnode, keep, last);
+	// 新的文件末尾所在扇区中之后的部分在这里清零，close只需要从下一个扇区开始整扇区清零
+	if (size < fnode->size && size % sec != 0 && last != 0) {
+		addr = FAT32_CLUS_OFFSET(fat32, last) + size % clus_size;
+		head = addr % sec;
+		bcache_invalidate(fnode->part->cache, addr - head, sec);
+		ffi->pread(fp, sector, sec, addr - head);
+		memset(sector + head, 0, sec - head);
+		fat32_write_sectors(ffi, fp, sector, sec, addr - head);
 	}
-	sdir->DIR_LastAccDate = sdir->DIR_WrtDate = (p->tm_year - 80) << 9 | p->tm_mon << 5 | p->tm_mday;
-	sdir->DIR_WrtTime						  = p->tm_hour << 11 | p->tm_min << 5 | p->tm_sec;
-	ffi->seek(fp, (fat32->data_start + (pos - 2) * fat32->BPB_SecPerClus) * SECTOR_SIZE, SEEK_SET);
-	ffi->write(fp, (uint8_t *)buf, SECTOR_SIZE);
-	fnode->offset += length;
+	fnode->size = size;
+	if (fnode->offset > size) fnode->offset = size;
+	time(&fnode->mtime);
+	fnode->dirty = 1;
 }
 
-struct fnode *FAT32_create_file(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
-								char *name, int len) {
-	char *buf = malloc(SECTOR_SIZE), filename_short[11];
-	unsigned int pos, i = 0, j, len2, name_count = 1, count = 1, name_len, tmp;
-	unsigned char checksum = 0;
-	struct pt_fat32 *fat32 = part->private_data;
-	struct FAT32_long_dir *ldir;
-	struct FAT32_dir *sdir;
-	struct fnode *fnode = malloc(sizeof(struct fnode));
-	uint32_t offset;
-	int flag;
+// 返回目录中offset处的目录项在映像中的字节偏移，目录没有这么长时返回0
+uint64_t fat32_dirent_pos(struct ffi *ffi, FILE *fp, struct fnode *dir, uint32_t offset) {
+	struct pt_fat32 *fat32 = dir->part->private_data;
+	uint32_t clus_size	   = FAT32_CLUS_SIZE(fat32);
+	uint32_t clus		   = fat32_map(ffi, fp, dir, offset / clus_size, 0, NULL);
 
-	time_t timep;
-	struct tm *p;
-	time(&timep);
-	p = gmtime(&timep);
-
-	fnode->name = malloc(len);
-	strncpy(fnode->name, name, len);
-	fnode->part	  = part;
-	fnode->parent = parent;
-	pos			  = parent->pos;
-	offset		  = (pos - 2) * fat32->BPB_SecPerClus + i / SECTOR_SIZE;
-	ffi->seek(fp, (offset + fat32->data_start) * SECTOR_SIZE, SEEK_SET);
-	ffi->read(fp, (uint8_t *)buf, SECTOR_SIZE);
-	do {
-		if (buf[0] == 0) break;
-		/**
-		 * 统计短目录项重名个数（只在目录项是长文件名时使用）
-		 * 如有重名，则短目录名以以下格式命名: SAMEFI~N.TXT (假设原名为samefilename.txt)
-		 * 如果当前数字不够，则将'~'前移
-		 */
-		if (buf[i % SECTOR_SIZE + 11] != FAT32_ATTR_LONG_NAME) {
-			flag = 1;
-			for (j = 0; j < 8 && buf[i % SECTOR_SIZE + j] != '~'; j++) {
-				if (buf[i % SECTOR_SIZE + j] != name[j]) {
-					flag = 0;
-					break;
-				}
-			}
-			if (flag) { name_count++; }
-		}
-		i += 0x20;
-
-		// 如果到了下一个簇，则获取下一个簇号
-		if (i / SECTOR_SIZE / fat32->BPB_SecPerClus && i % (SECTOR_SIZE * fat32->BPB_SecPerClus) == 0) {
-			pos	   = fat_next(ffi, fp, part, pos, 1, 1);
-			offset = (pos - 2) * fat32->BPB_SecPerClus + i / SECTOR_SIZE;
-			ffi->seek(fp, (offset + fat32->data_start) * SECTOR_SIZE, SEEK_SET);
-			ffi->read(fp, (uint8_t *)buf, SECTOR_SIZE);
-		}
-	} while (buf[i % SECTOR_SIZE]);
-
-	flag = 0;
-	pos	 = ((pos - 2) * fat32->BPB_SecPerClus * SECTOR_SIZE) + (i % (fat32->BPB_SecPerClus * SECTOR_SIZE));
-	int len_without_ext = len;
-	int len_ext			= 0;
-
-	if (len > 11) goto longname;	   // 文件名过长使用长文件名
-	if (name[0] == '.') goto longname; // "."开头的文件名也使用长文件名
-
-	for (i = 0; i < len && !(name[i] == '.' && i >= 1); i++)
-		if (islower(name[i])) flag |= 0x1;		// 文件名含小写
-		else if (isupper(name[i])) flag |= 0x2; // 文件名含大写
-	len_without_ext = i;
-	len_ext			= len - len_without_ext - 1;
-	if (i >= len) len_ext++; // 无扩展名文件
-	for (; i < len; i++)
-		if (islower(name[i])) flag |= 0x4;		// 扩展名含小写
-		else if (isupper(name[i])) flag |= 0x8; // 扩展名含大写
-
-	// 文件名和扩展名混杂大小写或长度过长则作为长目录项
-	if (len > 11 || len_ext > 3 || len_without_ext > 8 || (flag & 0x03) == 0x03 || (flag & 0x0c) == 0x0c) {
-	longname:
-		len2 = DIV_ROUND_UP(len, 13);
-
-		// 计算数字部分长度(十进制)
-		int tmp = name_count / 10;
-		while (tmp) {
-			count++;
-			tmp /= 10;
+	if (clus == 0) return 0;
+	return FAT32_CLUS_OFFSET(fat32, clus) + offset % clus_size;
+}
+
+// UTF-8转UTF-16，不支持BMP以外的字符，返回转换后的字符数
+static int fat32_utf8_to_utf16(const char *s, int len, uint16_t *out, int max) {
+	int i = 0, n = 0;
+	uint8_t c;
+
+	while (i < len && n < max) {
+		c = s[i];
+		if (c < 0x80) {
+			out[n++] = c;
+			i += 1;
+		} else if ((c & 0xe0) == 0xc0 && i + 1 < len) {
+			out[n++] = (c & 0x1f) << 6 | (s[i + 1] & 0x3f);
+			i += 2;
+		} else if ((c & 0xf0) == 0xe0 && i + 2 < len) {
+			out[n++] = (c & 0x0f) << 12 | (s[i + 1] & 0x3f) << 6 | (s[i + 2] & 0x3f);
+			i += 3;
+		} else {
+			out[n++] = '_';
+			i += (c & 0xf8) == 0xf0 ? 4 : 1;
 		}
+	}
+	return n;
+}
 
-		name_len = MIN(6, 8 - count - 1);
-		if (name[0] == '.') {
-			j = 1;
+// UTF-16转UTF-8，遇到0或0xffff结束，out至少要有len * 3 + 1字节
+static int fat32_utf16_to_utf8(const uint16_t *s, int len, char *out) {
+	int i, n = 0;
+
+	for (i = 0; i < len && s[i] != 0 && s[i] != 0xffff; i++) {
+		if (s[i] < 0x80) {
+			out[n++] = s[i];
+		} else if (s[i] < 0x800) {
+			out[n++] = 0xc0 | s[i] >> 6;
+			out[n++] = 0x80 | (s[i] & 0x3f);
 		} else {
-			j = 0;
+			out[n++] = 0xe0 | s[i] >> 12;
+			out[n++] = 0x80 | (s[i] >> 6 & 0x3f);
+			out[n++] = 0x80 | (s[i] & 0x3f);
 		}
-		for (i = 0; i < 8; i++, j++) {
-			if (i < name_len) filename_short[i] = toupper(name[j]);
-			else if (i == name_len) filename_short[i] = '~';
-			else if (i > name_len && i < 8)
-				filename_short[i] = ((name_count / (int)pow(10, 7 - i)) % 10 + '0');
-			else if (i < 8) filename_short[i] = ' ';
+	}
+	out[n] = 0;
+	return n;
+}
+
+// 把11字节的短文件名转换成"NAME.EXT"的形式，按NTRes恢复小写
+static void fat32_short_to_name(const struct FAT32_dir *sdir, char *out) {
+	int i, n = 0;
+
+	for (i = 0; i < 8 && sdir->DIR_Name[i] != ' '; i++)
+		out[n++] = sdir->DIR_NTRes & FAT32_BASE_L ? tolower(sdir->DIR_Name[i]) : sdir->DIR_Name[i];
+	if (n > 0 && (uint8_t)out[0] == 0x05) out[0] = (char)0xe5;
+	if (sdir->DIR_Ext[0] != ' ') out[n++] = '.';
+	for (i = 0; i < 3 && sdir->DIR_Ext[i] != ' '; i++)
+		out[n++] = sdir->DIR_NTRes & FAT32_EXT_L ? tolower(sdir->DIR_Ext[i]) : sdir->DIR_Ext[i];
+	out[n] = 0;
+}
+
+void fat32_dir_open(struct fat32_dir_iter *it, struct fnode *dir) {
+	struct pt_fat32 *fat32 = dir->part->private_data;
+
+	it->dir	   = dir;
+	it->offset = 0;
+	it->index  = UINT32_MAX;
+	it->ra_end = 0;
+	it->data   = NULL;
+	it->buf	   = malloc(FAT32_CLUS_SIZE(fat32));
+}
+
+void fat32_dir_close(struct fat32_dir_iter *it) {
+	free(it->buf);
+	it->buf = NULL;
+}
+
+/**
+ * 解析一个32字节的目录项，长目录项先暂存在st中，遇到短目录项时合成完整的文件名
+ * 返回1表示ent中得到了一个文件，0表示需要继续解析下一项，-1表示到达目录末尾
+ * 跳过已删除的目录项和卷标，长文件名的序号或校验和不对时只使用短文件名
+ */
+int fat32_decode_entry(struct fat32_lfn_state *st, const uint8_t *e, uint32_t offset, struct fat32_dirent *ent) {
+	const struct FAT32_long_dir *ldir;
+	uint8_t sum;
+
+	if (e[0] == 0x00) return -1;
+	if (e[0] == 0xe5) {
+		st->expect = -1;
+		return 0;
+	}
+	if ((e[11] & 0x3f) == FAT32_ATTR_LONG_NAME) {
+		ldir = (const struct FAT32_long_dir *)e;
+		if (ldir->LDIR_Ord & 0x40) { // 长文件名的最后一项最先出现
+			st->cnt		 = ldir->LDIR_Ord & 0x1f;
+			st->expect	 = st->cnt;
+			st->checksum = ldir->LDIR_Chksum;
+			st->first	 = offset;
+			if (st->cnt == 0 || st->cnt > 20) st->expect = -1;
 		}
-		for (; i < 11; i++) {
-			if (i - 8 < len_ext) {
-				filename_short[i] = name[len - len_ext + i - 8];
-			} else {
-				filename_short[i] = ' ';
-			}
+		if (st->expect <= 0 || (ldir->LDIR_Ord & 0x1f) != st->expect || ldir->LDIR_Chksum != st->checksum) {
+			st->expect = -1;
+			return 0;
 		}
-		FAT32_checksum(filename_short, checksum);
-		for (i = 0; i < len2; i++) {
-			int k;
-			if ((pos + i * 0x20) % SECTOR_SIZE == 0) {
-				ffi->seek(fp, (offset + fat32->data_start) * SECTOR_SIZE, SEEK_SET);
-				ffi->write(fp, (uint8_t *)buf, SECTOR_SIZE);
-				offset = (pos + i * 0x20) / SECTOR_SIZE;
-				ffi->seek(fp, (offset + fat32->data_start) * SECTOR_SIZE, SEEK_SET);
-				ffi->read(fp, (uint8_t *)buf, SECTOR_SIZE);
-			}
-			ldir		   = (struct FAT32_long_dir *)(buf + (pos + i * 0x20) % SECTOR_SIZE);
-			ldir->LDIR_Ord = len2 - i;
-			if (i == 0) ldir->LDIR_Ord |= 0x40;
-			int f = 0;
-			for (j = 0; (j % 13) < 5; j++) {
-				if (j < len - (len2 - i - 1) * 13) {
-					ldir->LDIR_Name1[j] = name[j];
-					f					= 1;
-				} else {
-					if (!f) {
-						ldir->LDIR_Name1[j] = 0xffff;
-					} else {
-						f					= 0;
-						ldir->LDIR_Name1[j] = 0;
-					}
-				}
-			}
-			ldir->LDIR_Attr	  = FAT32_ATTR_LONG_NAME;
-			ldir->LDIR_Type	  = 0;
-			ldir->LDIR_Chksum = checksum;
-			for (; (j % 13) < 11; j++) {
-				if (j < len - (len2 - i - 1) * 13) {
-					ldir->LDIR_Name2[j - 5] = name[j];
-					f						= 1;
-				} else {
-					if (!f) {
-						ldir->LDIR_Name2[j - 5] = 0xffff;
-					} else {
-						f						= 0;
-						ldir->LDIR_Name2[j - 5] = 0;
-					}
-				}
-			}
-			ldir->LDIR_FstClusLO = 0;
-			for (k = (j % 13); k < 13; k++) {
-				if (k < len - (len2 - i - 1) * 13) {
-					ldir->LDIR_Name3[k - 11] = name[k];
-					f						 = 1;
-				} else {
-					if (!f) {
-						ldir->LDIR_Name3[k - 11] = 0xffff;
-					} else {
-						f						 = 0;
-						ldir->LDIR_Name3[k - 11] = 0;
-					}
-				}
+		memcpy(st->lname + (st->expect - 1) * 13, ldir->LDIR_Name1, 10);
+		memcpy(st->lname + (st->expect - 1) * 13 + 5, ldir->LDIR_Name2, 12);
+		memcpy(st->lname + (st->expect - 1) * 13 + 11, ldir->LDIR_Name3, 4);
+		st->expect--;
+		return 0;
+	}
+	if (e[11] & FAT32_ATTR_VOLUME_ID) {
+		st->expect = -1;
+		return 0;
+	}
+
+	memcpy(&ent->sdir, e, sizeof(struct FAT32_dir));
+	fat32_short_to_name(&ent->sdir, ent->short_name);
+	ent->offset = offset;
+	sum			= 0;
+	FAT32_checksum(e, sum);
+	if (st->expect == 0 && sum == st->checksum) {
+		fat32_utf16_to_utf8(st->lname, st->cnt * 13, ent->name);
+		ent->first = st->first;
+	} else {
+		strcpy(ent->name, ent->short_name);
+		ent->first = offset;
+	}
+	st->expect = -1;
+	return 1;
+}
+
+// 按顺序读出目录中的下一个文件，目录一次读入一个簇，到达目录末尾时返回0
+int fat32_dir_next(struct ffi *ffi, FILE *fp, struct fat32_dir_iter *it, struct fat32_dirent *ent) {
+	struct pt_fat32 *fat32 = it->dir->part->private_data;
+	uint32_t clus_size	   = FAT32_CLUS_SIZE(fat32);
+	struct fat32_lfn_state st;
+	uint32_t clus, run;
+	int ret;
+
+	st.expect = -1;
+	for (;; it->offset += 32) {
+		if (it->offset / clus_size != it->index) {
+			clus = fat32_map(ffi, fp, it->dir, it->offset / clus_size, 0, &run);
+			if (clus == 0) return 0;
+			// 进入新的连续簇区间时让后端预读后面的簇
+			if (ffi->readahead != NULL && it->offset / clus_size >= it->ra_end) {
+				run = MIN(run, FAT32_READAHEAD);
+				ffi->readahead(fp, FAT32_CLUS_OFFSET(fat32, clus), run * clus_size);
+				it->ra_end = it->offset / clus_size + run;
 			}
+			it->data  = fat32_read_clus(ffi, fp, it->dir->part, clus, it->buf);
+			it->index = it->offset / clus_size;
 		}
-		pos += i * 0x20;
-		if (pos % SECTOR_SIZE == 0) {
-			ffi->seek(fp, (offset + fat32->data_start) * SECTOR_SIZE, SEEK_SET);
-			ffi->write(fp, (uint8_t *)buf, SECTOR_SIZE);
-			offset = pos / SECTOR_SIZE;
-			ffi->seek(fp, (offset + fat32->data_start) * SECTOR_SIZE, SEEK_SET);
-			ffi->read(fp, (uint8_t *)buf, SECTOR_SIZE);
+		ret = fat32_decode_entry(&st, it->data + it->offset % clus_size, it->offset, ent);
+		if (ret < 0) return 0;
+		if (ret > 0) {
+			it->offset += 32;
+			return 1;
 		}
-		for (i = 0; i < 11; i++) {
-			buf[pos % SECTOR_SIZE + i] = filename_short[i];
+	}
+}
+
+// 目录项中的日期和时间转换为time_t，目录项中保存的是UTC时间
+time_t fat32_time(uint16_t date, uint16_t tm) {
+	int y = (date >> 9) + 1980, m = (date >> 5) & 0x0f, d = date & 0x1f;
+	int64_t days;
+
+	if (m < 1 || m > 12 || d < 1) return 0;
+	// 从1970-01-01起的天数，把3月作为一年的第一个月，闰日在年末
+	if (m <= 2) y--;
+	days = 365LL * y + y / 4 - y / 100 + y / 400 + (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1 - 719468;
+	return (time_t)(days * 86400 + (tm >> 11) * 3600 + ((tm >> 5) & 0x3f) * 60 + (tm & 0x1f) * 2);
+}
+
+// 年份只有7位，1980年之前和2107年之后的时间取最近的边界，否则编码时会回绕
+time_t FAT32_clamp_time(time_t t) {
+	if (t < FAT32_TIME_MIN) return (time_t)FAT32_TIME_MIN;
+	if (t > FAT32_TIME_MAX) return (time_t)FAT32_TIME_MAX;
+	return t;
+}
+
+void *FAT32_diropen(struct ffi *ffi, FILE *fp, struct fnode *dir) {
+	struct fat32_readdir *handle = malloc(sizeof(struct fat32_readdir));
+
+	fat32_dir_open(&handle->it, dir);
+	return handle;
+}
+
+int FAT32_readdir(struct ffi *ffi, FILE *fp, void *handle, struct fs_dirent *ent) {
+	struct fat32_readdir *rd = handle;
+	struct FAT32_dir *sdir	 = &rd->ent.sdir;
+
+	do {
+		if (!fat32_dir_next(ffi, fp, &rd->it, &rd->ent)) return 0;
+	} while (strcmp(rd->ent.name, ".") == 0 || strcmp(rd->ent.name, "..") == 0);
+	strcpy(ent->name, rd->ent.name);
+	ent->is_dir = (sdir->DIR_Attr & FAT32_ATTR_DIRECTORY) != 0;
+	ent->attr	= sdir->DIR_Attr;
+	ent->size	= sdir->DIR_FileSize;
+	ent->mtime	= fat32_time(sdir->DIR_WrtDate, sdir->DIR_WrtTime);
+	return 1;
+}
+
+void FAT32_dirclose(void *handle) {
+	fat32_dir_close(&((struct fat32_readdir *)handle)->it);
+	free(handle);
+}
+
+/**
+ * 根目录没有目录项，属性固定为目录
+ * 簇链没有以结束标记结尾(有环、簇号越界或指向空闲簇)时返回-1，其余信息仍然填写
+ */
+int FAT32_stat(struct ffi *ffi, FILE *fp, struct fnode *fnode, struct fs_stat *st) {
+	struct pt_fat32 *fat32 = fnode->part->private_data;
+	struct extent *ext;
+	uint32_t i;
+
+	st->size		= fnode->size;
+	st->attr		= fnode->parent != NULL ? FAT32_get_attr(ffi, fp, fnode->part, fnode) : FAT32_ATTR_DIRECTORY;
+	st->mtime		= fnode->mtime;
+	st->block_size	= FAT32_CLUS_SIZE(fat32);
+	st->blocks		= 0;
+	st->extents		= 0;
+	st->first_block = fnode->pos;
+	fat32_map(ffi, fp, fnode, UINT32_MAX, 0, NULL); // 建立整个簇链的簇区间表
+	for (i = 0; i < fnode->extent_cnt; i++)
+		st->blocks += fnode->extents[i].len;
+	st->extents = fnode->extent_cnt;
+	if (fnode->extent_cnt == 0) return fnode->pos == 0 ? 0 : -1;
+	ext = &fnode->extents[fnode->extent_cnt - 1];
+	return (fat32->fat[ext->pclus + ext->len - 1] & 0x0fffffff) >= 0x0ffffff8 ? 0 : -1;
+}
+
+/**
+ * 把文件的簇区间转换为映像中的字节区间，最后一个区间截断到文件大小
+ * 簇链比文件短时区间的总长度小于文件大小，由调用者检查
+ */
+int FAT32_get_runs(struct ffi *ffi, FILE *fp, struct fnode *fnode, struct fs_run **runs) {
+	struct pt_fat32 *fat32 = fnode->part->private_data;
+	uint32_t clus_size	   = FAT32_CLUS_SIZE(fat32);
+	uint32_t left		   = fnode->size;
+	struct extent *ext;
+	int i, n = 0;
+
+	*runs = NULL;
+	if (fnode->size == 0) return 0;
+	fat32_map(ffi, fp, fnode, (fnode->size - 1) / clus_size, 0, NULL);
+	*runs = malloc(fnode->extent_cnt * sizeof(struct fs_run));
+	for (i = 0; i < fnode->extent_cnt && left > 0; i++) {
+		ext				  = &fnode->extents[i];
+		(*runs)[n].offset = FAT32_CLUS_OFFSET(fat32, ext->pclus);
+		(*runs)[n].length = MIN(left, (uint64_t)ext->len * clus_size);
+		bcache_invalidate(fnode->part->cache, (*runs)[n].offset, (*runs)[n].length);
+		left -= (*runs)[n++].length;
+	}
+	return n;
+}
+
+// 不区分大小写的字符串哈希(FNV-1a)
+static uint32_t fat32_name_hash(const char *name) {
+	uint32_t h = 2166136261u;
+	while (*name)
+		h = (h ^ (uint8_t)tolower(*name++)) * 16777619u;
+	return h;
+}
+
+static char *fat32_strdup_lower(const char *s) {
+	char *p = strdup(s), *q;
+	for (q = p; *q; q++)
+		*q = tolower(*q);
+	return p;
+}
+
+static void fat32_index_insert(struct fat32_dir_index *idx, struct fat32_index_entry *e) {
+	struct fat32_index_entry **lhash, **shash, *p, *next;
+	uint32_t i, size;
+
+	// 平均每个哈希链超过一项时扩大一倍
+	if (idx->count >= idx->hash_size) {
+		size  = idx->hash_size * 2;
+		lhash = calloc(size, sizeof(struct fat32_index_entry *));
+		shash = calloc(size, sizeof(struct fat32_index_entry *));
+		for (i = 0; i < idx->hash_size; i++) {
+			for (p = idx->lhash[i]; p != NULL; p = next) {
+				next						 = p->lnext;
+				p->lnext					 = lhash[p->lhash & (size - 1)];
+				lhash[p->lhash & (size - 1)] = p;
+			}
+			for (p = idx->shash[i]; p != NULL; p = next) {
+				next						 = p->snext;
+				p->snext					 = shash[p->shash & (size - 1)];
+				shash[p->shash & (size - 1)] = p;
+			}
 		}
-		sdir		   = (struct FAT32_dir *)(buf + pos % SECTOR_SIZE);
-		sdir->DIR_Attr = FAT32_ATTR_ARCHIVE;
-
-		sdir->DIR_LastAccDate = sdir->DIR_CrtDate = sdir->DIR_WrtDate =
-			(p->tm_year - 80) << 9 | p->tm_mon << 5 | p->tm_mday;
-		sdir->DIR_CrtTime = sdir->DIR_WrtTime = p->tm_hour << 11 | p->tm_min << 5 | p->tm_sec >> 1;
-		sdir->DIR_CrtTimeTenth				  = p->tm_sec * 10;
-
-		int file_clus		= fat32_alloc_clus(ffi, fp, part, 0, 1);
-		sdir->DIR_FstClusHI = file_clus >> 16;
-		sdir->DIR_FstClusLO = file_clus & 0xffff;
-		sdir->DIR_FileSize	= 0;
-	} else {
-		for (i = 0, j = 0; i < 8 && name[i] != '.' && j < len; i++, j++)
-			buf[pos % SECTOR_SIZE + i] = toupper(name[j]);
-		for (; i < 8; i++)
-			buf[pos % SECTOR_SIZE + i] = ' ';
-		for (j++; i < 11; i++, j++) {
-			if (j < len) {
-				buf[pos % SECTOR_SIZE + i] = toupper(name[j]);
-			} else {
-				buf[pos % SECTOR_SIZE + i] = ' ';
+		free(idx->lhash);
+		free(idx->shash);
+		idx->lhash	   = lhash;
+		idx->shash	   = shash;
+		idx->hash_size = size;
+	}
+	i			  = e->lhash & (idx->hash_size - 1);
+	e->lnext	  = idx->lhash[i];
+	idx->lhash[i] = e;
+	i			  = e->shash & (idx->hash_size - 1);
+	e->snext	  = idx->shash[i];
+	idx->shash[i] = e;
+	idx->count++;
+}
+
+static void fat32_index_add(struct fat32_dir_index *idx, const char *name, const char *short_name, uint32_t offset,
+							uint32_t first, uint32_t clus, uint8_t attr) {
+	struct fat32_index_entry *e = malloc(sizeof(struct fat32_index_entry));
+
+	e->name		  = fat32_strdup_lower(name);
+	e->short_name = fat32_strdup_lower(short_name);
+	e->lhash	  = fat32_name_hash(name);
+	e->shash	  = fat32_name_hash(short_name);
+	e->offset	  = offset;
+	e->first	  = first;
+	e->clus		  = clus;
+	e->attr		  = attr;
+	fat32_index_insert(idx, e);
+}
+
+static void fat32_index_remove(struct fat32_dir_index *idx, struct fat32_index_entry *e) {
+	struct fat32_index_entry **p;
+
+	for (p = &idx->lhash[e->lhash & (idx->hash_size - 1)]; *p != e; p = &(*p)->lnext)
+		;
+	*p = e->lnext;
+	for (p = &idx->shash[e->shash & (idx->hash_size - 1)]; *p != e; p = &(*p)->snext)
+		;
+	*p = e->snext;
+	idx->count--;
+	free(e->name);
+	free(e->short_name);
+	free(e);
+}
+
+// 按长文件名或短文件名查找，不区分大小写
+static struct fat32_index_entry *fat32_index_find(struct fat32_dir_index *idx, const char *name) {
+	struct fat32_index_entry *e;
+	uint32_t h = fat32_name_hash(name);
+
+	for (e = idx->lhash[h & (idx->hash_size - 1)]; e != NULL; e = e->lnext)
+		if (e->lhash == h && strcasecmp(e->name, name) == 0) return e;
+	for (e = idx->shash[h & (idx->hash_size - 1)]; e != NULL; e = e->snext)
+		if (e->shash == h && strcasecmp(e->short_name, name) == 0) return e;
+	return NULL;
+}
+
+/**
+ * 取得目录的索引，第一次访问时扫描整个目录建立
+ * 索引按目录的第一个簇挂在分区上，同一目录的不同fnode共用
+ */
+struct fat32_dir_index *fat32_index_get(struct ffi *ffi, FILE *fp, struct fnode *dir) {
+	struct pt_fat32 *fat32 = dir->part->private_data;
+	struct fat32_dir_index *idx;
+	struct fat32_dir_iter it;
+	struct fat32_dirent ent;
+	uint32_t slot = dir->pos & (FAT32_INDEX_SLOTS - 1);
+
+	for (idx = fat32->dir_index[slot]; idx != NULL; idx = idx->next)
+		if (idx->clus == dir->pos) return idx;
+
+	idx			   = calloc(1, sizeof(struct fat32_dir_index));
+	idx->clus	   = dir->pos;
+	idx->hash_size = 16;
+	idx->lhash	   = calloc(idx->hash_size, sizeof(struct fat32_index_entry *));
+	idx->shash	   = calloc(idx->hash_size, sizeof(struct fat32_index_entry *));
+	fat32_dir_open(&it, dir);
+	while (fat32_dir_next(ffi, fp, &it, &ent)) {
+		if (strcmp(ent.name, ".") == 0 || strcmp(ent.name, "..") == 0) continue;
+		fat32_index_add(idx, ent.name, ent.short_name, ent.offset, ent.first,
+						(ent.sdir.DIR_FstClusHI << 16 | ent.sdir.DIR_FstClusLO) & 0x0fffffff, ent.sdir.DIR_Attr);
+	}
+	idx->end = it.offset; // 第一个空目录项或目录末尾
+	fat32_dir_close(&it);
+	idx->next			   = fat32->dir_index[slot];
+	fat32->dir_index[slot] = idx;
+	return idx;
+}
+
+void fat32_index_free(struct _partition_s *part) {
+	struct pt_fat32 *fat32 = part->private_data;
+	struct fat32_dir_index *idx, *next;
+	struct fat32_index_entry *e, *enext;
+	uint32_t i, j;
+
+	for (i = 0; i < FAT32_INDEX_SLOTS; i++) {
+		for (idx = fat32->dir_index[i]; idx != NULL; idx = next) {
+			next = idx->next;
+			for (j = 0; j < idx->hash_size; j++) {
+				for (e = idx->lhash[j]; e != NULL; e = enext) {
+					enext = e->lnext;
+					free(e->name);
+					free(e->short_name);
+					free(e);
+				}
 			}
+			free(idx->lhash);
+			free(idx->shash);
+			free(idx);
 		}
-		sdir		   = (struct FAT32_dir *)(buf + pos % SECTOR_SIZE);
-		sdir->DIR_Attr = FAT32_ATTR_ARCHIVE;
+		fat32->dir_index[i] = NULL;
+	}
+}
+
+static int fat32_short_char(uint8_t c) {
+	return isalnum(c) || c >= 0x80 || strchr("$%'-_@~`!(){}^#&", c) != NULL;
+}
 
-		sdir->DIR_NTRes = 0;
-		if (flag & 0x01) sdir->DIR_NTRes |= FAT32_BASE_L;
-		if (flag & 0x04) sdir->DIR_NTRes |= FAT32_EXT_L;
+/**
+ * 生成11字节的短文件名，能直接作为8.3名称保存时返回0并通过ntres给出大小写标记，
+ * 否则生成NAME~N.EXT形式的不重名的短文件名并返回1，需要另外写长目录项
+ */
+static int fat32_make_short_name(struct fat32_dir_index *idx, const char *name, int len, uint8_t *short_name,
+								 uint8_t *ntres) {
+	int i, dot = -1, base_len, ext_len, n, tail;
+	int flag = 0, valid = 1;
+	char buf[16], num[12];
 
-		sdir->DIR_LastAccDate = sdir->DIR_CrtDate = sdir->DIR_WrtDate =
-			(p->tm_year - 80) << 9 | p->tm_mon << 5 | p->tm_mday;
-		sdir->DIR_CrtTime = sdir->DIR_WrtTime = p->tm_hour << 11 | p->tm_min << 5 | p->tm_sec >> 1;
-		sdir->DIR_CrtTimeTenth				  = p->tm_sec * 10;
+	for (i = 0; i < len; i++)
+		if (name[i] == '.') dot = i;
+	base_len = dot < 0 ? len : dot;
+	ext_len	 = dot < 0 ? 0 : len - dot - 1;
+
+	// 判断能否直接使用8.3名称
+	for (i = 0; i < len; i++) {
+		if (i == dot) continue;
+		if (name[i] == '.' || !fat32_short_char(name[i]) || (uint8_t)name[i] >= 0x80) valid = 0;
+		if (islower(name[i])) flag |= i < base_len ? 0x1 : 0x4;
+		else if (isupper(name[i])) flag |= i < base_len ? 0x2 : 0x8;
+	}
+	if (valid && base_len >= 1 && base_len <= 8 && ext_len <= 3 && (dot < 0 || ext_len > 0) &&
+		(flag & 0x03) != 0x03 && (flag & 0x0c) != 0x0c) {
+		memset(short_name, ' ', 11);
+		for (i = 0; i < base_len; i++)
+			short_name[i] = toupper(name[i]);
+		for (i = 0; i < ext_len; i++)
+			short_name[8 + i] = toupper(name[dot + 1 + i]);
+		*ntres = (flag & 0x01 ? FAT32_BASE_L : 0) | (flag & 0x04 ? FAT32_EXT_L : 0);
+		snprintf(buf, sizeof(buf), "%.*s%s%.*s", base_len, name, ext_len ? "." : "", ext_len, name + dot + 1);
+		if (fat32_index_find(idx, buf) == NULL) return 0;
+	}
+
+	// 生成基本名，去掉开头的'.'和所有空格，非法字符替换为'_'
+	memset(short_name, ' ', 11);
+	for (i = 0, n = 0; i < base_len && n < 8; i++) {
+		if (name[i] == ' ' || (name[i] == '.' && n == 0)) continue;
+		short_name[n++] = fat32_short_char(name[i]) && (uint8_t)name[i] < 0x80 && name[i] != '.' ? toupper(name[i])
+																								  : '_';
+	}
+	if (n == 0) short_name[n++] = '_';
+	base_len = n;
+	for (i = dot + 1, n = 0; dot > 0 && i < len && n < 3; i++) {
+		if (name[i] == ' ') continue;
+		short_name[8 + n++] = fat32_short_char(name[i]) && (uint8_t)name[i] < 0x80 ? toupper(name[i]) : '_';
+	}
+	ext_len = n;
+	*ntres	= 0;
 
-		int file_clus		= fat32_alloc_clus(ffi, fp, part, 0, 1);
-		sdir->DIR_FstClusHI = file_clus >> 16;
-		sdir->DIR_FstClusLO = file_clus & 0xffff;
-		sdir->DIR_FileSize	= 0;
+	// 添加数字后缀直到不与目录中已有的短文件名重复
+	for (tail = 1; tail < 1000000; tail++) {
+		n = snprintf(num, sizeof(num), "~%d", tail);
+		i = MIN(base_len, 8 - n);
+		memcpy(short_name + i, num, n);
+		snprintf(buf, sizeof(buf), "%.*s%s%.*s", i + n, short_name, ext_len ? "." : "", ext_len, short_name + 8);
+		if (fat32_index_find(idx, buf) == NULL) break;
 	}
-	fnode->dir_offset = (pos % (SECTOR_SIZE * fat32->BPB_SecPerClus));
-	fnode->pos		  = sdir->DIR_FstClusHI << 16 | sdir->DIR_FstClusLO;
+	return 1;
+}
+
+struct fnode *FAT32_create_file(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
+								char *name, int len) {
+	struct pt_fat32 *fat32 = part->private_data;
+	uint32_t clus_size	   = FAT32_CLUS_SIZE(fat32);
+	struct fat32_dir_index *idx;
+	struct FAT32_long_dir ldir;
+	struct FAT32_dir sdir;
+	struct fnode *fnode;
+	uint16_t lname[20 * 13];
+	uint8_t short_name[11], checksum = 0, ntres;
+	uint32_t offset, file_clus, got;
+	int llen, cnt = 0, i, j;
+	char short_str[13], *fname;
+	time_t timep;
+	struct tm *p;
+
+	if (len <= 0) return NULL;
+	fname = strndup(name, len);
+	idx	  = fat32_index_get(ffi, fp, parent);
+	if (fat32_index_find(idx, fname) != NULL) {
+		free(fname);
+		return NULL;
+	}
+	llen = fat32_utf8_to_utf16(name, len, lname, 255);
+	memset(&sdir, 0, sizeof(struct FAT32_dir));
+	if (fat32_make_short_name(idx, name, len, short_name, &ntres)) cnt = DIV_ROUND_UP(llen, 13);
+
+	// 新目录项追加在目录末尾，目录不够长时分配清零的新簇
+	offset = idx->end;
+	if (fat32_map(ffi, fp, parent, (offset + (cnt + 1) * 32 - 1) / clus_size, FAT32_ALLOC_ZERO, NULL) == 0) {
+		free(fname);
+		return NULL;
+	}
+	// 文件的簇马上会被写入，不需要清零，目录的簇由FAT32_mkdir清零
+	file_clus = fat32_alloc_run(part, 0, 1, &got);
+	if (file_clus == 0) {
+		free(fname);
+		return NULL;
+	}
+
+	FAT32_checksum(short_name, checksum);
+	for (i = 0; i < cnt; i++) {
+		int ord = cnt - i, k;
+		uint16_t ch[13];
+		for (j = 0; j < 13; j++) {
+			k	  = (ord - 1) * 13 + j;
+			ch[j] = k < llen ? lname[k] : k == llen ? 0 : 0xffff;
+		}
+		ldir.LDIR_Ord		= ord | (i == 0 ? 0x40 : 0);
+		ldir.LDIR_Attr		= FAT32_ATTR_LONG_NAME;
+		ldir.LDIR_Type		= 0;
+		ldir.LDIR_Chksum	= checksum;
+		ldir.LDIR_FstClusLO = 0;
+		memcpy(ldir.LDIR_Name1, ch, 10);
+		memcpy(ldir.LDIR_Name2, ch + 5, 12);
+		memcpy(ldir.LDIR_Name3, ch + 11, 4);
+		bcache_write(part->cache, (uint8_t *)&ldir, sizeof(struct FAT32_long_dir),
+					 fat32_dirent_pos(ffi, fp, parent, offset + i * 32));
+	}
+
+	// 短文件名的8字节基本名和3字节扩展名分别复制到两个字段
+	memcpy(sdir.DIR_Name, short_name, 8);
+	memcpy(sdir.DIR_Ext, short_name + 8, 3);
+	time(&timep);
+	p					 = gmtime(&timep);
+	sdir.DIR_Attr		 = FAT32_ATTR_ARCHIVE;
+	sdir.DIR_NTRes		 = ntres;
+	sdir.DIR_LastAccDate = sdir.DIR_CrtDate = sdir.DIR_WrtDate = FAT32_DATE(p);
+	sdir.DIR_CrtTime = sdir.DIR_WrtTime = FAT32_TIME(p);
+	sdir.DIR_CrtTimeTenth				= p->tm_sec % 2 * 100;
+	sdir.DIR_FstClusHI					= file_clus >> 16;
+	sdir.DIR_FstClusLO					= file_clus & 0xffff;
+	sdir.DIR_FileSize					= 0;
+	bcache_write(part->cache, (uint8_t *)&sdir, sizeof(struct FAT32_dir),
+				 fat32_dirent_pos(ffi, fp, parent, offset + cnt * 32));
+
+	fat32_short_to_name(&sdir, short_str);
+	fat32_index_add(idx, fname, short_str, offset + cnt * 32, offset, file_clus, sdir.DIR_Attr);
+	idx->end = offset + (cnt + 1) * 32;
+
+	fnode			  = calloc(1, sizeof(struct fnode));
+	fnode->name		  = fname;
+	fnode->part		  = part;
+	fnode->parent	  = parent;
+	fnode->dir_offset = offset + cnt * 32;
+	fnode->pos		  = file_clus;
 	fnode->offset	  = 0;
-	fnode->size		  = sdir->DIR_FileSize;
-	fnode->child = fnode->next = NULL;
-	sdir					   = malloc(sizeof(struct FAT32_dir));
-	memcpy(sdir, buf + pos % SECTOR_SIZE, sizeof(struct FAT32_dir));
-	ffi->seek(fp, (offset + fat32->data_start) * SECTOR_SIZE, SEEK_SET);
-	ffi->write(fp, (uint8_t *)buf, SECTOR_SIZE);
-	free(buf);
+	fnode->size		  = 0;
 	return fnode;
 }
 
 void FAT32_delete_file(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *fnode) {
-	char *buf = malloc(SECTOR_SIZE);
-	unsigned int pos, i;
-	struct pt_fat32 *fat32 = part->private_data;
-	uint32_t offset;
-	uint8_t f = 1;
-	offset	  = fat32->data_start + (fnode->parent->pos - 2) * fat32->BPB_SecPerClus +
-			 fnode->dir_offset / SECTOR_SIZE;
-	ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-	ffi->read(fp, (uint8_t *)buf, SECTOR_SIZE);
-	pos = fnode->dir_offset;
-	do {
-		if (pos % SECTOR_SIZE == 0 && pos >= SECTOR_SIZE) {
-			ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-			ffi->write(fp, (uint8_t *)buf, SECTOR_SIZE);
-			offset -= 1;
-			ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-			ffi->read(fp, (uint8_t *)buf, SECTOR_SIZE);
-		}
-		buf[pos % SECTOR_SIZE] = 0xe5;
-		pos -= 0x20;
-	} while (buf[pos % SECTOR_SIZE + 11] & FAT32_ATTR_LONG_NAME);
-	ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-	ffi->write(fp, (uint8_t *)buf, SECTOR_SIZE);
-	pos = fnode->pos; // 释放文件在文件分配表中对应的簇
-	while (f) {
+	struct fat32_dir_index *idx = fat32_index_get(ffi, fp, fnode->parent);
+	struct fat32_index_entry *e = fat32_index_find(idx, fnode->name);
+	uint32_t pos, i, off;
+	uint8_t deleted = 0xe5;
+
+	if (e == NULL || e->offset != fnode->dir_offset) return;
+	// 短目录项和它前面的长目录项都标记为已删除
+	for (off = e->first; off <= e->offset; off += 32)
+		bcache_write(part->cache, &deleted, 1, fat32_dirent_pos(ffi, fp, fnode->parent, off));
+	pos = e->clus; // 释放文件在文件分配表中对应的簇
+	while (pos >= 2 && pos < 0x0ffffff8) {
 		i = find_member_in_fat(ffi, fp, part, pos);
-		if (i >= 0x0ffffff8) f = 0;
 		fat32_free_clus(ffi, fp, part, 0, pos);
 		pos = i;
 	}
-	free(buf);
+	fat32_index_remove(idx, e);
 }
 
 struct fnode *FAT32_mkdir(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
 						  char *name, int len) {
-	uint32_t pos;
+	uint64_t pos;
 	struct fnode *fnode;
 	struct pt_fat32 *fat32 = part->private_data;
-	struct FAT32_dir tmpdir, *sdir;
+	struct FAT32_dir tmpdir;
 
-	sdir = malloc(sizeof(struct FAT32_dir));
-	strncpy((char *)tmpdir.DIR_Name, ".       ", 8);
-	strncpy((char *)tmpdir.DIR_Ext, "   ", 3);
+	fnode = FAT32_create_file(ffi, fp, part, parent, name, len);
+	if (fnode == NULL) return NULL;
+	FAT32_set_attr(ffi, fp, part, fnode, FAT32_ATTR_DIRECTORY);
+	bcache_read(part->cache, (uint8_t *)&tmpdir, sizeof(struct FAT32_dir),
+				fat32_dirent_pos(ffi, fp, parent, fnode->dir_offset));
+	memcpy(tmpdir.DIR_Name, ".       ", 8);
+	memcpy(tmpdir.DIR_Ext, "   ", 3);
 	tmpdir.DIR_NTRes = 0x00;
 	tmpdir.DIR_Attr	 = FAT32_ATTR_DIRECTORY;
-	fnode			 = FAT32_create_file(ffi, fp, part, parent, name, len);
-	FAT32_set_attr(ffi, fp, part, fnode, FAT32_ATTR_DIRECTORY);
-	pos = fat_next(ffi, fp, fnode->part, fnode->parent->pos,
-				   fnode->dir_offset / (SECTOR_SIZE * fat32->BPB_SecPerClus), 0);
-	ffi->seek(fp, (fat32->data_start + (pos - 2) * fat32->BPB_SecPerClus) * SECTOR_SIZE + fnode->dir_offset,
-			  SEEK_SET);
-	ffi->read(fp, (uint8_t *)sdir, sizeof(struct FAT32_dir));
-	tmpdir.DIR_CrtDate		= sdir->DIR_CrtDate;
-	tmpdir.DIR_CrtTime		= sdir->DIR_CrtTime;
-	tmpdir.DIR_CrtTimeTenth = sdir->DIR_CrtTimeTenth;
-	tmpdir.DIR_WrtDate		= sdir->DIR_WrtDate;
-	tmpdir.DIR_WrtTime		= sdir->DIR_WrtTime;
-	tmpdir.DIR_LastAccDate	= sdir->DIR_LastAccDate;
-	tmpdir.DIR_FstClusHI	= sdir->DIR_FstClusHI;
-	tmpdir.DIR_FstClusLO	= sdir->DIR_FstClusLO;
-	tmpdir.DIR_FileSize		= sdir->DIR_FileSize;
-	pos						= fnode->pos;
-	ffi->seek(fp, (fat32->data_start + (pos - 2) * fat32->BPB_SecPerClus) * SECTOR_SIZE, SEEK_SET);
-	ffi->write(fp, (uint8_t *)&tmpdir, sizeof(struct FAT32_dir));
-	strncpy((char *)tmpdir.DIR_Name, "..      ", 8);
-	tmpdir.DIR_FstClusHI = parent->pos >> 16;
-	tmpdir.DIR_FstClusLO = parent->pos & 0xff;
-	ffi->write(fp, (uint8_t *)&tmpdir, sizeof(struct FAT32_dir));
-	free(sdir);
+	pos				 = FAT32_CLUS_OFFSET(fat32, fnode->pos);
+	fat32_zero(ffi, fp, part, pos, FAT32_CLUS_SIZE(fat32));
+	bcache_write(part->cache, (uint8_t *)&tmpdir, sizeof(struct FAT32_dir), pos);
+	// 上级目录是根目录时".."的簇号为0
+	memcpy(tmpdir.DIR_Name, "..      ", 8);
+	tmpdir.DIR_FstClusHI = parent->pos == fat32->BPB_RootClus ? 0 : parent->pos >> 16;
+	tmpdir.DIR_FstClusLO = parent->pos == fat32->BPB_RootClus ? 0 : parent->pos & 0xffff;
+	bcache_write(part->cache, (uint8_t *)&tmpdir, sizeof(struct FAT32_dir), pos + sizeof(struct FAT32_dir));
 	return fnode;
 }
 
-void FAT32_close(struct fnode *fnode) {
+void FAT32_close(struct ffi *ffi, FILE *fp, struct fnode *fnode) {
+	struct pt_fat32 *fat32 = fnode->part->private_data;
+	uint32_t clus_size	   = FAT32_CLUS_SIZE(fat32);
+	uint32_t clus, off;
+
+	// 数据簇分配时不清零，写过的文件把最后一个簇中文件末尾之后的部分清零
+	// 末尾所在扇区的其余部分已经在写入或截断时补0，这里从下一个扇区开始，清零的范围是整扇区的
+	off = DIV_ROUND_UP(fnode->size % clus_size, fat32->BPB_BytesPerSec) * fat32->BPB_BytesPerSec;
+	if (fnode->dirty && fnode->size % clus_size != 0 && off < clus_size) {
+		clus = fat32_map(ffi, fp, fnode, fnode->size / clus_size, 0, NULL);
+		if (clus != 0) fat32_zero(ffi, fp, fnode->part, FAT32_CLUS_OFFSET(fat32, clus) + off, clus_size - off);
+	}
+	FAT32_flush(ffi, fp, fnode);
 	free(fnode->name);
+	free(fnode->extents);
+	free(fnode);
 	return;
 }
 
-struct fnode *FAT32_open(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
-						 char *filename) {
-	int i, j, x;
-	struct FAT32_long_dir *ldir;
-	struct FAT32_dir *sdir;
-	struct fnode *fnode	   = malloc(sizeof(struct fnode));
+// 读取一个簇，块缓存不缓存映射的映像，这时直接返回映像中的地址，否则通过缓存读入buf
+uint8_t *fat32_read_clus(struct ffi *ffi, FILE *fp, struct _partition_s *part, uint32_t clus, uint8_t *buf) {
 	struct pt_fat32 *fat32 = part->private_data;
-	uint32_t offset;
-	uint8_t flag = 0, f = 1;
-	unsigned int cc;
-	uint8_t buf[fat32->BPB_SecPerClus * SECTOR_SIZE];
-	fnode->part	  = parent->part;
-	fnode->parent = parent;
-	int len		  = strlen(filename);
-	cc			  = parent->pos;
-
-	while (f) {
-		int tmp = find_member_in_fat(ffi, fp, part, cc);
-		if (tmp >= 0x0ffffff8) { f = 0; }
-		offset = fat32->data_start + (cc - 2) * fat32->BPB_SecPerClus;
-		ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-		ffi->read(fp, (uint8_t *)buf, fat32->BPB_SecPerClus * SECTOR_SIZE);
-		for (i = 0x00; i < SECTOR_SIZE * fat32->BPB_SecPerClus; i += 0x20) {
-			if (buf[i + 11] == FAT32_ATTR_LONG_NAME) continue;
-			if (buf[i] == 0xe5 || buf[i] == 0x00 || buf[i] == 0x05) continue;
-			ldir = (struct FAT32_long_dir *)(buf + i) - 1;
-			sdir = (struct FAT32_dir *)(buf + i);
-			j	 = 0;
-
-			// 如果是长目录项
-			while (ldir->LDIR_Attr == FAT32_ATTR_LONG_NAME && ldir->LDIR_Ord != 0xe5) {
-				for (x = 0; x < 5; x++) {
-					if (j > len && ldir->LDIR_Name1[x] == 0xffff) continue;
-					else if (j > len || ldir->LDIR_Name1[x] != (unsigned short)(filename[j++])) goto cmp_fail;
-				}
-				for (x = 0; x < 6; x++) {
-					if (j > len && ldir->LDIR_Name2[x] == 0xffff) continue;
-					else if (j > len || ldir->LDIR_Name2[x] != (unsigned short)(filename[j++])) goto cmp_fail;
-				}
-				for (x = 0; x < 2; x++) {
-					if (j > len && ldir->LDIR_Name3[x] == 0xffff) continue;
-					else if (j > len || ldir->LDIR_Name3[x] != (unsigned short)(filename[j++])) goto cmp_fail;
-				}
+	uint32_t size		   = FAT32_CLUS_SIZE(fat32);
+	uint64_t offset		   = FAT32_CLUS_OFFSET(fat32, clus);
+	uint8_t *data;
 
-				if (j >= len) {
-					flag = 1;
-					goto cmp_success;
-				}
+	if (part->cache->passthrough && (data = ffi->map(fp, offset, size)) != NULL) return data;
+	bcache_read(part->cache, buf, size, offset);
+	return buf;
+}
 
-				ldir--;
-			}
+// 在目录索引中查找文件(dir为0)或目录(dir为1)
+static struct fnode *fat32_lookup(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
+								  char *name, int dir) {
+	struct fat32_index_entry *e = fat32_index_find(fat32_index_get(ffi, fp, parent), name);
+	struct FAT32_dir sdir;
+	struct fnode *fnode;
 
-			// 如果是短目录项
-			j = 0;
-			if (sdir->DIR_Attr & FAT32_ATTR_DIRECTORY) continue;
-			for (x = 0; x < 8; x++) {
-				if (sdir->DIR_Name[x] == ' ') {
-					if (!(sdir->DIR_Attr & FAT32_ATTR_DIRECTORY)) {
-						if (filename[j] == '.' || filename[j] == 0) continue;
-						else if (sdir->DIR_Name[x] == filename[j]) {
-							j++;
-							continue;
-						} else goto cmp_fail;
-					} else goto cmp_fail;
-				} else if ((sdir->DIR_Name[x] >= 'A' && sdir->DIR_Name[x] <= 'Z') ||
-						   (sdir->DIR_Name[x] >= 'a' && sdir->DIR_Name[x] <= 'z')) {
-					if (sdir->DIR_NTRes & FAT32_BASE_L) {
-						if (j < len && sdir->DIR_Name[x] + 32 == filename[j]) {
-							j++;
-							continue;
-						} else goto cmp_fail;
-					} else {
-						if (j < len && sdir->DIR_Name[x] == filename[j]) {
-							j++;
-							continue;
-						} else goto cmp_fail;
-					}
-				} else if (sdir->DIR_Name[x] >= '0' && sdir->DIR_Name[x] <= '9') {
-					if (j < len && sdir->DIR_Name[x] == filename[j]) {
-						j++;
-						continue;
-					} else goto cmp_fail;
-				} else {
-					j++;
-				}
-			}
-			j++;
-			for (x = 0; x < 3; x++) {
-				if ((sdir->DIR_Ext[x] >= 'A' && sdir->DIR_Ext[x] <= 'Z') ||
-					(sdir->DIR_Ext[x] >= 'a' && sdir->DIR_Ext[x] <= 'z')) {
-					if (sdir->DIR_NTRes & FAT32_BASE_L) {
-						if (j < len && sdir->DIR_Ext[x] + 32 == filename[j]) {
-							j++;
-							continue;
-						} else goto cmp_fail;
-					} else {
-						if (j < len && sdir->DIR_Ext[x] == filename[j]) {
-							j++;
-							continue;
-						} else goto cmp_fail;
-					}
-				} else if (sdir->DIR_Ext[x] >= '0' && sdir->DIR_Ext[x] <= '9') {
-					if (j < len && sdir->DIR_Ext[x] == filename[j]) {
-						j++;
-						continue;
-					} else goto cmp_fail;
-				} else if (sdir->DIR_Ext[x] == ' ') {
-					if (sdir->DIR_Ext[x] == filename[j]) {
-						if (sdir->DIR_Ext[x] == filename[j]) {
-							j++;
-							continue;
-						} else goto cmp_fail;
-					}
-				} else {
-					goto cmp_fail;
-				}
-			}
-			flag = 1;
-			goto cmp_success;
-		cmp_fail:;
-		}
-		cc = find_member_in_fat(ffi, fp, part, cc);
-	};
-cmp_success:
-	if (flag) {
-		fnode->name = malloc(len);
-		strncpy(fnode->name, filename, len);
-		fnode->dir_offset = i;
-		fnode->pos		  = (sdir->DIR_FstClusHI << 16 | sdir->DIR_FstClusLO) & 0x0fffffff;
-		fnode->size		  = sdir->DIR_FileSize;
-		fnode->offset	  = 0;
-		fnode->child = fnode->next = NULL;
-		return fnode;
-	} else {
-		free(fnode);
-		return NULL;
-	}
+	if (e == NULL || !(e->attr & FAT32_ATTR_DIRECTORY) != !dir) return NULL;
+	bcache_read(part->cache, (uint8_t *)&sdir, sizeof(struct FAT32_dir),
+				fat32_dirent_pos(ffi, fp, parent, e->offset));
+	fnode			  = calloc(1, sizeof(struct fnode));
+	fnode->name		  = strdup(name);
+	fnode->part		  = part;
+	fnode->parent	  = parent;
+	fnode->dir_offset = e->offset;
+	fnode->pos		  = e->clus;
+	fnode->size		  = sdir.DIR_FileSize;
+	fnode->offset	  = 0;
+	fnode->mtime	  = fat32_time(sdir.DIR_WrtDate, sdir.DIR_WrtTime);
+	return fnode;
 }
 
+struct fnode *FAT32_open(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
+						 char *filename) {
+	return fat32_lookup(ffi, fp, part, parent, filename, 0);
+}
+
+/**
+ * 打开的目录按分区内的完整路径缓存，同一个目录只查找一次
+ * 缓存中没有时从根目录开始逐级查找，途经的目录也加入缓存
+ */
 struct fnode *FAT32_open_dir(struct ffi *ffi, FILE *fp, struct _partition_s *part, char *path) {
-	int i;
-	struct fnode *fnode = NULL;
+	int i, j, len;
+	struct fnode *fnode, *dir;
 	char name[256];
 
-	if (*path == '/') path++;
-	fnode = part->root;
+	while (*path == '/')
+		path++;
+	len = strlen(path);
+	while (len > 0 && path[len - 1] == '/')
+		len--;
+	if (len == 0) return part->root;
+	if ((fnode = dcache_lookup(part, path, len)) != NULL) return fnode;
 
-	// 从根目录开始
-	while (*path != 0) {
-		i = 0;
-		while (path[i] != '/' && path[i] != 0)
-			i++;
-		if (i >= 255) { return NULL; }
-		strncpy(name, path, i);
-		name[i] = 0;
-		fnode	= FAT32_find_dir(ffi, fp, part, fnode, name);
-		if (fnode == NULL) { return NULL; }
-		path += i + 1;
+	fnode = part->root;
+	for (i = 0; i < len; i = j + 1) {
+		j = i;
+		while (j < len && path[j] != '/')
+			j++;
+		if (j - i >= 255) { return NULL; }
+		if (j == i) continue;
+		dir = dcache_lookup(part, path, j);
+		if (dir == NULL) {
+			memcpy(name, path + i, j - i);
+			name[j - i] = 0;
+			dir			= FAT32_find_dir(ffi, fp, part, fnode, name);
+			if (dir == NULL) { return NULL; }
+			dcache_insert(part, path, j, dir);
+		}
+		fnode = dir;
 	}
 	return fnode;
 }
 
 struct fnode *FAT32_find_dir(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
 							 char *name) {
-	unsigned int i, j, cc, x, pos;
-	uint8_t flag, f;
-	uint8_t *buf		   = malloc(((struct pt_fat32 *)part->private_data)->BPB_SecPerClus * SECTOR_SIZE);
+	return fat32_lookup(ffi, fp, part, parent, name, 1);
+}
+
+uint8_t FAT32_get_attr(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *fnode) {
+	struct FAT32_dir sdir;
+	uint64_t pos = fat32_dirent_pos(ffi, fp, fnode->parent, fnode->dir_offset);
+
+	if (pos == 0) return 0;
+	bcache_read(part->cache, (uint8_t *)&sdir, sizeof(struct FAT32_dir), pos);
+	return sdir.DIR_Attr;
+}
+
+void FAT32_set_attr(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *fnode, uint8_t attr) {
+	struct fat32_index_entry *e;
+	struct FAT32_dir sdir;
+	uint64_t pos = fat32_dirent_pos(ffi, fp, fnode->parent, fnode->dir_offset);
+
+	if (pos == 0) return;
+	bcache_read(part->cache, (uint8_t *)&sdir, sizeof(struct FAT32_dir), pos);
+	sdir.DIR_Attr = attr;
+	bcache_write(part->cache, (uint8_t *)&sdir, sizeof(struct FAT32_dir), pos);
+	e = fat32_index_find(fat32_index_get(ffi, fp, fnode->parent), fnode->name);
+	if (e != NULL && e->offset == fnode->dir_offset) e->attr = attr;
+}
+
+// 把映像中的一段范围清零，后端支持时在映像文件中打洞
+void fat32_zero(struct ffi *ffi, FILE *fp, partition_t *part, uint64_t offset, uint64_t size) {
+	bcache_invalidate(part->cache, offset, size);
+	ffi->zero(fp, offset, size);
+}
+
+// 分配一个清零的簇，用于目录
+int fat32_alloc_clus(struct ffi *ffi, FILE *fp, partition_t *part, int last_clus, int first) {
+	uint32_t i, got;
 	struct pt_fat32 *fat32 = part->private_data;
-	struct FAT32_long_dir *ldir;
-	struct FAT32_dir *sdir;
-	struct fnode *dir;
-	int len = strlen(name);
-	uint32_t offset;
-	dir			= malloc(sizeof(struct fnode));
-	dir->parent = parent;
-	dir->part	= part;
-	flag		= 0;
-	f			= 1;
-	cc			= parent->pos;
-	while (f) {
-		if (find_member_in_fat(ffi, fp, part, cc) >= 0x0ffffff8) f = 0;
-		offset = fat32->data_start + (cc - 2) * fat32->BPB_SecPerClus;
-		ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-		ffi->read(fp, (uint8_t *)buf, fat32->BPB_SecPerClus * SECTOR_SIZE);
-		for (i = 0x00; i < SECTOR_SIZE * fat32->BPB_SecPerClus; i += 0x20) {
-			if (buf[i + 11] == FAT32_ATTR_LONG_NAME) continue;
-			if (buf[i] == 0xe5 || buf[i] == 0x00 || buf[i] == 0x05) continue;
-			ldir = (struct FAT32_long_dir *)(buf + i) - 1;
-			j	 = 0;
-
-			// 如果是长目录项
-			while (ldir->LDIR_Attr == FAT32_ATTR_LONG_NAME && ldir->LDIR_Ord != 0xe5) {
-				for (x = 0; x < 5; x++) {
-					if (j > len && ldir->LDIR_Name1[x] == 0xffff) continue;
-					else if (j > len || ldir->LDIR_Name1[x] != (unsigned short)(name[j++])) goto cmp_fail;
-				}
-				for (x = 0; x < 6; x++) {
-					if (j > len && ldir->LDIR_Name2[x] == 0xffff) continue;
-					else if (j > len || ldir->LDIR_Name2[x] != (unsigned short)(name[j++])) goto cmp_fail;
-				}
-				for (x = 0; x < 2; x++) {
-					if (j > len && ldir->LDIR_Name3[x] == 0xffff) continue;
-					else if (j > len || ldir->LDIR_Name3[x] != (unsigned short)(name[j++])) goto cmp_fail;
-				}
 
-				if (j >= len) {
-					flag = 1;
-					sdir = (struct FAT32_dir *)(buf + i);
-					goto cmp_success;
-				}
+	i = fat32_alloc_run(part, first ? 0 : last_clus, 1, &got);
+	if (i == 0) return 0; // 分区已满
+	fat32_zero(ffi, fp, part, FAT32_CLUS_OFFSET(fat32, i),
+			   FAT32_CLUS_SIZE(fat32));
+	return i;
+}
 
-				ldir--;
-			}
+#define FREE_MAP_TEST(map, i) ((map)[(i) / 64] >> ((i) % 64) & 1)
 
-			// 如果是短目录项
-			j	 = 0;
-			sdir = (struct FAT32_dir *)(buf + i);
-			for (x = 0; x < 11; x++) {
-				if (sdir->DIR_Name[x] == ' ') {
-					if (sdir->DIR_Attr & FAT32_ATTR_DIRECTORY) {
-						if (sdir->DIR_Name[x] == name[j]) {
-							j++;
-							continue;
-						}
-					}
-				} else if ((sdir->DIR_Name[x] >= 'A' && sdir->DIR_Name[x] <= 'Z') ||
-						   (sdir->DIR_Name[x] >= 'a' && sdir->DIR_Name[x] <= 'z')) {
-					if (sdir->DIR_NTRes & FAT32_BASE_L) {
-						if (j < len && sdir->DIR_Name[x] + 32 == name[j]) {
-							j++;
-							continue;
-						} else {
-							goto cmp_fail;
-						}
-					} else {
-						if (j < len && sdir->DIR_Name[x] == name[j]) {
-							j++;
-							continue;
-						} else {
-							goto cmp_fail;
-						}
-					}
-
-				} else if (j < len && sdir->DIR_Name[x] == name[j]) {
-					j++;
-					continue;
-				} else if (sdir->DIR_Name[x] >= '0' && sdir->DIR_Name[x] <= '9') {
-					goto cmp_fail;
-				} else {
-					goto cmp_fail;
-				}
-			}
-			flag = 1;
-			goto cmp_success;
-		cmp_fail:;
+// 从start开始查找第一个空闲簇，没有则返回fat_entries
+uint32_t fat32_next_free(struct pt_fat32 *fat32, uint32_t start) {
+	uint32_t i = start / 64;
+	uint64_t word;
+
+	if (start >= fat32->fat_entries) return fat32->fat_entries;
+	word = fat32->free_map[i] & (~0ULL << (start % 64));
+	while (word == 0) {
+		if (++i >= DIV_ROUND_UP(fat32->fat_entries, 64)) return fat32->fat_entries;
+		word = fat32->free_map[i];
+	}
+	return MIN(i * 64 + __builtin_ctzll(word), fat32->fat_entries);
+}
+
+// 返回从start开始连续空闲簇的个数，最多统计到max个
+static uint32_t fat32_free_run(struct pt_fat32 *fat32, uint32_t start, uint32_t max) {
+	return fat32_bitmap_run(fat32->free_map, start, start + MIN(max, fat32->fat_entries - start));
+}
+
+/**
+ * 从next_free开始分配最多want个连续的簇并连成簇链，返回第一个簇号，分区已满时返回0
+ * 找不到足够长的连续空闲区时使用扫描到的最长空闲区，实际分配的个数由got返回
+ * last_clus不为0时新簇链接在它之后
+ */
+uint32_t fat32_alloc_run(struct _partition_s *part, uint32_t last_clus, uint32_t want, uint32_t *got) {
+	struct pt_fat32 *fat32 = part->private_data;
+	uint32_t start, len, best = 0, best_len = 0, scanned = 0, i;
+	uint32_t total = fat32->fat_entries - 2;
+
+	*got = 0;
+	if (fat32->free_count == 0 || want == 0) return 0;
+	start = fat32->next_free;
+	while (scanned < total) {
+		i = fat32_next_free(fat32, start);
+		if (i >= fat32->fat_entries) { // 回到分区开头继续查找
+			scanned += fat32->fat_entries - start;
+			start = 2;
+			continue;
 		}
-		cc = find_member_in_fat(ffi, fp, part, cc);
-	};
-cmp_success:
-	if (flag) {
-		dir->name = malloc(len);
-		strncpy(dir->name, name, len);
-		dir->dir_offset = i;
-		dir->pos		= (sdir->DIR_FstClusHI << 16 | sdir->DIR_FstClusLO);
-		free(buf);
-		return dir;
-	} else {
-		free(dir);
-		free(buf);
-		return NULL;
+		len = fat32_free_run(fat32, i, want);
+		if (len > best_len) {
+			best	 = i;
+			best_len = len;
+		}
+		if (len >= want) break;
+		scanned += i + len - start;
+		start = i + len;
 	}
+	if (best_len == 0) return 0;
+
+	for (i = best; i < best + best_len - 1; i++)
+		fat32_set_member(part, i, i + 1);
+	fat32_set_member(part, best + best_len - 1, 0x0ffffff8);
+	if (last_clus >= 2) fat32_set_member(part, last_clus, best);
+	fat32->next_free = best + best_len;
+	if (fat32->next_free >= fat32->fat_entries) fat32->next_free = 2;
+	*got = best_len;
+	return best;
 }
 
-uint8_t FAT32_get_attr(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *fnode) {
-	uint8_t attr;
-	uint32_t pos, length;
-	struct FAT32_dir *sdir;
-	struct pt_fat32 *fat32;
-
-	sdir  = malloc(sizeof(struct FAT32_dir));
-	fat32 = (struct pt_fat32 *)part->private_data;
-	pos	  = fnode->dir_offset / (SECTOR_SIZE * fat32->BPB_SecPerClus);
-	pos	  = fat_next(ffi, fp, fnode->part, fnode->parent->pos, pos, 0);
-	pos	  = fat32->data_start + (pos - 2) * fat32->BPB_SecPerClus;
-	pos	  = pos * SECTOR_SIZE + fnode->dir_offset % SECTOR_SIZE;
-	if (pos == 0) {
-		free(sdir);
-		return 0;
+int fat32_free_clus(struct ffi *ffi, FILE *fp, partition_t *part, int last_clus, int clus) {
+	struct pt_fat32 *fat32 = part->private_data;
+	if (last_clus < 3 && clus < 3) return -1;
+	if (last_clus > 2 && clus > 2) {
+		fat32_set_member(part, last_clus, fat32->fat[clus]);
+		fat32_set_member(part, clus, 0x00);
+	} else if (clus > 2) {
+		fat32_set_member(part, clus, 0x00);
 	}
-	ffi->seek(fp, pos, SEEK_SET);
-	ffi->read(fp, (uint8_t *)sdir, sizeof(struct FAT32_dir));
-	attr = sdir->DIR_Attr;
-	free(sdir);
-	return attr;
+	return 0;
 }
 
-void FAT32_set_attr(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *fnode, uint8_t attr) {
-	uint32_t pos, length;
-	struct FAT32_dir *sdir;
-	struct pt_fat32 *fat32;
-
-	sdir  = malloc(sizeof(struct FAT32_dir));
-	fat32 = (struct pt_fat32 *)part->private_data;
-	pos	  = fnode->dir_offset / (SECTOR_SIZE * fat32->BPB_SecPerClus);
-	pos	  = fat_next(ffi, fp, fnode->part, fnode->parent->pos, pos, 0);
-	pos	  = fat32->data_start + (pos - 2) * fat32->BPB_SecPerClus;
-	pos	  = pos * SECTOR_SIZE + fnode->dir_offset % SECTOR_SIZE;
-	if (pos == 0) {
-		free(sdir);
-		return;
+uint32_t find_member_in_fat(struct ffi *ffi, FILE *fp, struct _partition_s *part, uint32_t i) {
+	struct pt_fat32 *fat32 = part->private_data;
+	if (i >= fat32->fat_entries) return 0x0fffffff;
+	return fat32->fat[i] & 0x0fffffff;
+}
+
+void fat32_set_member(struct _partition_s *part, uint32_t i, uint32_t value) {
+	struct pt_fat32 *fat32 = part->private_data;
+	if (i >= fat32->fat_entries) return;
+	if ((fat32->fat[i] & 0x0fffffff) == 0 && (value & 0x0fffffff) != 0) {
+		fat32->free_map[i / 64] &= ~(1ULL << (i % 64));
+		fat32->free_count--;
+	} else if ((fat32->fat[i] & 0x0fffffff) != 0 && (value & 0x0fffffff) == 0) {
+		fat32->free_map[i / 64] |= 1ULL << (i % 64);
+		fat32->free_count++;
 	}
-	ffi->seek(fp, pos, SEEK_SET);
-	ffi->read(fp, (uint8_t *)sdir, sizeof(struct FAT32_dir));
-	sdir->DIR_Attr = attr;
-	ffi->seek(fp, pos, SEEK_SET);
-	ffi->write(fp, (uint8_t *)sdir, sizeof(struct FAT32_dir));
-	free(sdir);
+	// 高4位保留，不能修改
+	fat32->fat[i] = (fat32->fat[i] & 0xf0000000) | (value & 0x0fffffff);
+	fat32->fat_dirty[i / (fat32->BPB_BytesPerSec / 4)] = 1;
 }
 
-int fat32_alloc_clus(struct ffi *ffi, FILE *fp, partition_t *part, int last_clus, int first) {
-	int buf[SECTOR_SIZE / 4];
-	int i				   = 3, j;
+/**
+ * 挂载时把第一个FAT整个读入内存，之后的查询和修改都在内存中进行，
+ * 修改过的扇区在卸载时由fat32_flush_fat统一写回所有FAT
+ */
+int fat32_load_fat(struct ffi *ffi, FILE *fp, struct _partition_s *part) {
 	struct pt_fat32 *fat32 = part->private_data;
-	uint32_t offset		   = 0;
-	ffi->seek(fp, (fat32->fat_start + (last_clus / (SECTOR_SIZE / 4))) * SECTOR_SIZE, SEEK_SET);
-	ffi->read(fp, (uint8_t *)buf, SECTOR_SIZE);
-	while (buf[i % (SECTOR_SIZE / 4)]) {
-		i++;
-		if (i % (SECTOR_SIZE / 4) == 0) {
-			ffi->seek(fp, (fat32->fat_start + i / (SECTOR_SIZE / 4)) * SECTOR_SIZE, SEEK_CUR);
-			ffi->read(fp, (uint8_t *)buf, SECTOR_SIZE);
-		}
+	uint32_t entries	   = fat32->BPB_FATSz32 * (fat32->BPB_BytesPerSec / 4);
+	uint32_t clusters	   = (fat32->BPB_TotSec32 - (fat32->data_start - part->start)) / fat32->BPB_SecPerClus + 2;
+	uint32_t i;
+
+	// 后端支持映射时直接在映像中修改第一个FAT
+	fat32->fat = NULL;
+	if (ffi->map != NULL)
+		fat32->fat = (uint32_t *)ffi->map(fp, FAT32_SECTOR_OFFSET(fat32, fat32->fat_start), fat32->BPB_FATSz32 * fat32->BPB_BytesPerSec);
+	fat32->fat_mapped = fat32->fat != NULL;
+	if (!fat32->fat_mapped) fat32->fat = malloc(fat32->BPB_FATSz32 * fat32->BPB_BytesPerSec);
+	fat32->fat_dirty = calloc(fat32->BPB_FATSz32, 1);
+	if (fat32->fat == NULL || fat32->fat_dirty == NULL) {
+		if (!fat32->fat_mapped) free(fat32->fat);
+		free(fat32->fat_dirty);
+		return -1;
 	}
-	for (j = 0; j < fat32->BPB_NumFATs; j++) {
-		offset = fat32->fat_start + j * fat32->BPB_FATSz32 + (i / (SECTOR_SIZE / 4));
-		ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-		ffi->read(fp, (uint8_t *)buf, SECTOR_SIZE);
-		buf[i % (SECTOR_SIZE / 4)] = 0x0ffffff8;
-		ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-		ffi->write(fp, (uint8_t *)buf, SECTOR_SIZE);
-		if (!first) {
-			offset = fat32->fat_start + j * fat32->BPB_FATSz32 + (last_clus / (SECTOR_SIZE / 4));
-			ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-			ffi->read(fp, (uint8_t *)buf, SECTOR_SIZE);
-			buf[last_clus % (SECTOR_SIZE / 4)] = i;
-			ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-			ffi->write(fp, (uint8_t *)buf, SECTOR_SIZE);
-		}
+	if (!fat32->fat_mapped) {
+		ffi->pread(fp, (uint8_t *)fat32->fat, fat32->BPB_FATSz32 * fat32->BPB_BytesPerSec, FAT32_SECTOR_OFFSET(fat32, fat32->fat_start));
 	}
+	fat32->fat_entries = MIN(entries, clusters);
 
-	memset(buf, 0, SECTOR_SIZE);
-	for (j = 0; j < fat32->BPB_SecPerClus; j++) {
-		ffi->seek(fp, (fat32->data_start + (i - 2) * fat32->BPB_SecPerClus + j) * SECTOR_SIZE, SEEK_SET);
-		ffi->write(fp, (uint8_t *)buf, SECTOR_SIZE);
+	// 建立空闲簇位图，FSInfo中的空闲簇数可能不准确，以FAT为准
+	fat32->free_map	  = calloc(DIV_ROUND_UP(fat32->fat_entries, 64), sizeof(uint64_t));
+	fat32->free_count = fat32_scan_zero(fat32->fat, fat32->fat_entries, 0x0fffffff, fat32->free_map);
+	for (i = 0; i < 2; i++) { // 0号和1号表项不是簇
+		if (FREE_MAP_TEST(fat32->free_map, i)) fat32->free_count--;
+		fat32->free_map[0] &= ~(1ULL << i);
 	}
-	return i;
+	// 0xffffffff表示空闲簇数未知，不算不一致
+	fat32->fsinfo_stale =
+		fat32->FSInfo.FSI_Free_Count != 0xffffffff && fat32->FSInfo.FSI_Free_Count != fat32->free_count;
+	fat32->next_free = fat32->FSInfo.FSI_Nxt_Free;
+	if (fat32->next_free < 2 || fat32->next_free >= fat32->fat_entries) fat32->next_free = 2;
+	return 0;
 }
 
-int fat32_free_clus(struct ffi *ffi, FILE *fp, partition_t *part, int last_clus, int clus) {
-	int buf1[128], buf2[128];
-	int j;
+// 按扇区顺序写回脏FAT扇区，连续的脏扇区合并为一次写入
+void fat32_flush_fat(struct ffi *ffi, FILE *fp, struct _partition_s *part) {
 	struct pt_fat32 *fat32 = part->private_data;
-	uint32_t offset;
-	if (last_clus < 3 && clus < 3) return -1;
-	for (j = 0; j < fat32->BPB_NumFATs; j++) {
-		if (last_clus > 2 && clus > 2) {
-			offset = fat32->fat_start + j * fat32->BPB_FATSz32 + last_clus / 128;
-			ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-			ffi->read(fp, (uint8_t *)buf1, SECTOR_SIZE);
-			if (clus / 128 != last_clus / 128) {
-				offset = fat32->fat_start + j * fat32->BPB_FATSz32 + clus / 128;
-				ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-				ffi->read(fp, (uint8_t *)buf2, SECTOR_SIZE);
-				buf1[last_clus % 128] = buf2[clus % 128];
-				buf2[clus % 128]	  = 0x00;
-				ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-				ffi->write(fp, (uint8_t *)buf2, SECTOR_SIZE);
-			} else {
-				buf1[last_clus % 128] = buf1[clus % 128];
-				buf1[clus % 128]	  = 0x00;
-			}
-			offset = fat32->fat_start + j * fat32->BPB_FATSz32 + last_clus / 128;
-			ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-			ffi->write(fp, (uint8_t *)buf1, SECTOR_SIZE);
-		} else if (clus > 2) {
-			offset = fat32->fat_start + j * fat32->BPB_FATSz32 + clus / 128;
-			ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-			ffi->read(fp, (uint8_t *)buf1, SECTOR_SIZE);
-			buf1[clus % 128] = 0x00;
-			ffi->seek(fp, offset * SECTOR_SIZE, SEEK_SET);
-			ffi->write(fp, (uint8_t *)buf1, SECTOR_SIZE);
+	uint32_t i, j, k;
+
+	for (k = fat32->fat_mapped ? 1 : 0; k < fat32->BPB_NumFATs; k++) {
+		for (i = 0; i < fat32->BPB_FATSz32; i = j + 1) {
+			for (j = i; j < fat32->BPB_FATSz32 && fat32->fat_dirty[j]; j++)
+				;
+			if (j == i) continue;
+			ffi->pwrite(fp, (uint8_t *)fat32->fat + i * fat32->BPB_BytesPerSec, (j - i) * fat32->BPB_BytesPerSec,
+						FAT32_SECTOR_OFFSET(fat32, fat32->fat_start + k * fat32->BPB_FATSz32 + i));
 		}
 	}
-	return 0;
+	memset(fat32->fat_dirty, 0, fat32->BPB_FATSz32);
 }
 
-uint32_t find_member_in_fat(struct ffi *ffi, FILE *fp, struct _partition_s *part, uint32_t i) {
-	uint32_t buf[SECTOR_SIZE / sizeof(unsigned int)], next_clus;
+void FAT32_umount(struct ffi *ffi, FILE *fp, struct _partition_s *part) {
 	struct pt_fat32 *fat32 = part->private_data;
-	uint32_t offset		   = fat32->BPB_RevdSecCnt + (i / 128);
-	ffi->seek(fp, (offset + part->start) * SECTOR_SIZE, SEEK_SET);
-	ffi->read(fp, (uint8_t *)buf, SECTOR_SIZE);
-	next_clus = buf[i % 128];
-	return next_clus;
-}
-
-uint32_t fat_next(struct ffi *ffi, FILE *fp, struct _partition_s *part, uint32_t clus, int next, int alloc) {
-	uint32_t i, tmp, c = clus;
-	for (i = 0; i < next; i++) {
-		tmp = find_member_in_fat(ffi, fp, part, c);
-		if (tmp < 0x0ffffff8) c = tmp;
-		else {
-			if (alloc) { c = fat32_alloc_clus(ffi, fp, part, c, 0); }
-			return c;
+	uint8_t *sector;
+
+	fat32_index_free(part);
+	fat32_flush_fat(ffi, fp, part);
+	if (fat32->FSInfo.FSI_Free_Count != fat32->free_count || fat32->FSInfo.FSI_Nxt_Free != fat32->next_free) {
+		fat32->FSInfo.FSI_Free_Count = fat32->free_count;
+		fat32->FSInfo.FSI_Nxt_Free	 = fat32->next_free;
+		// 扇区中FSInfo之后的部分是保留的0，整扇区写入避免读-改-写
+		sector = calloc(1, fat32->BPB_BytesPerSec);
+		memcpy(sector, &fat32->FSInfo, sizeof(struct FS_Info));
+		ffi->pwrite(fp, sector, fat32->BPB_BytesPerSec, FAT32_SECTOR_OFFSET(fat32, part->start + fat32->BPB_FSInfo));
+		free(sector);
+	}
+
+	// 映射的FAT属于后端的映射，由ffi->exit解除
+	if (!fat32->fat_mapped) free(fat32->fat);
+	free(fat32->fat_dirty);
+	free(fat32->free_map);
+	free(fat32->dir_index);
+	free(fat32->bounce);
+	free(fat32);
+	free(part->root->name);
+	free(part->root->extents);
+	free(part->root);
+	free(part->name);
+	part->private_data = NULL;
+	part->root		   = NULL;
+	part->name		   = NULL;
+}
+
+/**
+ * 在从start开始的sectors个扇区上创建FAT32文件系统，扇区大小为sector_size字节
+ * 写入引导扇区、FSInfo和它们的备份以及两个FAT的第一个扇区，其余部分应当已经是0
+ */
+int fat32_mkfs(struct ffi *ffi, FILE *fp, uint32_t start, uint32_t sectors, uint32_t clus_size,
+			   uint32_t sector_size) {
+	struct pt_fat32 *fat32 = calloc(1, sizeof(struct pt_fat32));
+	uint64_t bytes		   = (uint64_t)sectors * sector_size;
+	uint32_t spc, fatsz, clusters, i;
+	uint8_t *sector;
+	uint32_t *fat;
+
+	// 默认簇大小与Windows格式化时相同
+	if (clus_size == 0) {
+		if (bytes <= 8ULL << 30) clus_size = 4096;
+		else if (bytes <= 16ULL << 30) clus_size = 8192;
+		else if (bytes <= 32ULL << 30) clus_size = 16384;
+		else clus_size = 32768;
+	}
+	spc = clus_size / sector_size;
+	if (spc == 0 || spc > 128 || (spc & (spc - 1)) != 0 || clus_size % sector_size != 0) {
+		free(fat32);
+		return -1;
+	}
+
+	// FAT大小和簇数互相依赖，从1开始增大直到FAT能容纳所有簇
+	fatsz = 1;
+	for (;;) {
+		if (FAT32_RSVD_SECTORS + 2 * fatsz >= sectors) {
+			free(fat32);
+			return -1;
 		}
+		clusters = (sectors - FAT32_RSVD_SECTORS - 2 * fatsz) / spc;
+		if (DIV_ROUND_UP((uint64_t)(clusters + 2) * 4, sector_size) <= fatsz) break;
+		fatsz = DIV_ROUND_UP((uint64_t)(clusters + 2) * 4, sector_size);
 	}
-	return c;
+	if (clusters < 65525 || clusters > 0x0ffffff5) { // 簇数不在FAT32的范围内
+		free(fat32);
+		return -1;
+	}
+
+	memcpy(fat32->BS_jmpBoot, "\xeb\x58\x90", 3);
+	memcpy(fat32->BS_OEMName, "MSWIN4.1", 8);
+	fat32->BPB_BytesPerSec = sector_size;
+	fat32->BPB_SecPerClus  = spc;
+	fat32->BPB_RevdSecCnt  = FAT32_RSVD_SECTORS;
+	fat32->BPB_NumFATs	   = 2;
+	fat32->BPB_Media	   = 0xf8;
+	fat32->BPB_SecPerTrk   = 63;
+	fat32->BPB_NumHeads	   = 255;
+	fat32->BPB_HiddSec	   = start;
+	fat32->BPB_TotSec32	   = sectors;
+	fat32->BPB_FATSz32	   = fatsz;
+	fat32->BPB_RootClus	   = 2;
+	fat32->BPB_FSInfo	   = 1;
+	fat32->BPB_BkBootSec   = 6;
+	fat32->BS_DrvNum	   = 0x80;
+	fat32->BS_BootSig	   = 0x29;
+	fat32->BS_VolID		   = time(NULL);
+	memcpy(fat32->BS_VolLab, "NO NAME    ", 11);
+	memcpy(fat32->BS_FilSysType, "FAT32   ", 8);
+	fat32->Signature = 0xaa55;
+
+	fat32->FSInfo.FSI_LeadSig	 = 0x41615252;
+	fat32->FSInfo.FSI_StrucSig	 = 0x61417272;
+	fat32->FSInfo.FSI_Free_Count = clusters - 1; // 根目录占用一个簇
+	fat32->FSInfo.FSI_Nxt_Free	 = 3;
+	fat32->FSInfo.FSI_TrailSig	 = 0xaa550000;
+
+	// 都按整扇区写入，其余部分为0
+	sector = calloc(1, sector_size);
+	for (i = 0; i <= fat32->BPB_BkBootSec; i += fat32->BPB_BkBootSec) {
+		memcpy(sector, fat32, FAT32_BOOT_SIZE);
+		ffi->pwrite(fp, sector, sector_size, FAT32_SECTOR_OFFSET(fat32, start + i));
+		memcpy(sector, &fat32->FSInfo, sizeof(struct FS_Info));
+		ffi->pwrite(fp, sector, sector_size, FAT32_SECTOR_OFFSET(fat32, start + i + 1));
+	}
+
+	memset(sector, 0, sector_size);
+	fat	   = (uint32_t *)sector;
+	fat[0] = 0x0ffffff8;
+	fat[1] = 0x0fffffff;
+	fat[2] = 0x0ffffff8; // 根目录
+	for (i = 0; i < 2; i++) {
+		ffi->pwrite(fp, sector, sector_size, FAT32_SECTOR_OFFSET(fat32, start + FAT32_RSVD_SECTORS + i * fatsz));
+	}
+	free(sector);
+	free(fat32);
+	return 0;
 }
+
+/**
+ * 查找文件第lclus个簇对应的物理簇号，未找到或簇链有环、簇号越界时返回0
+ * 簇区间表按需沿簇链向后扩展，已建立的部分用二分查找定位
+ * 簇链不够长时按alloc分配新簇：FAT32_ALLOC_DATA分配的簇不清零，由调用者写入，
+ * FAT32_ALLOC_ZERO分配清零的簇(用于目录)，run不为空时返回从该簇起连续的簇数
+ */
+uint32_t fat32_map(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint32_t lclus, int alloc, uint32_t *run) {
+	struct pt_fat32 *fat32 = fnode->part->private_data;
+	struct extent *ext;
+	uint32_t last, next, lo, hi, mid, got;
+
+	if (fnode->extent_cnt == 0) {
+		if (fnode->pos < 2 || fnode->pos >= fat32->fat_entries) return 0;
+		fnode->extent_max = 4;
+		fnode->extents	  = malloc(fnode->extent_max * sizeof(struct extent));
+		fnode->extents[0] = (struct extent){0, fnode->pos, 1};
+		fnode->extent_cnt = 1;
+	}
+
+	ext = &fnode->extents[fnode->extent_cnt - 1];
+	while (lclus >= ext->lclus + ext->len) {
+		// 簇链不会比分区的簇数长，更长说明有环，指向分区之外的簇号说明簇链已损坏，都不再向后扩展
+		if (ext->lclus + ext->len >= fat32->fat_entries) return 0;
+		last = ext->pclus + ext->len - 1;
+		next = find_member_in_fat(ffi, fp, fnode->part, last);
+		if (next >= fat32->fat_entries && next < 0x0ffffff8) return 0;
+		if (next < 2 || next >= 0x0ffffff8) {
+			if (!alloc) return 0;
+			if (alloc == FAT32_ALLOC_ZERO) next = fat32_alloc_clus(ffi, fp, fnode->part, last, 0);
+			else next = fat32_alloc_run(fnode->part, last, 1, &got);
+			if (next == 0) return 0;
+		}
+		if (next == last + 1) {
+			ext->len++;
+			continue;
+		}
+		lo = ext->lclus + ext->len;
+		if (fnode->extent_cnt == fnode->extent_max) {
+			fnode->extent_max *= 2;
+			fnode->extents = realloc(fnode->extents, fnode->extent_max * sizeof(struct extent));
+		}
+		fnode->extents[fnode->extent_cnt] = (struct extent){lo, next, 1};
+		ext								  = &fnode->extents[fnode->extent_cnt++];
+	}
+
+	lo = 0;
+	hi = fnode->extent_cnt - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (fnode->extents[mid].lclus <= lclus) lo = mid;
+		else hi = mid - 1;
+	}
+	ext = &fnode->extents[lo];
+	if (run != NULL) *run = ext->lclus + ext->len - lclus;
+	return ext->pclus + (lclus - ext->lclus);
+}
\ No newline at end of file
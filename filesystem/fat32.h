@@ -1,8 +1,12 @@
 #pragma once
+#include "../cache.h"
 #include "../ff.h"
 #include "../fs.h"
 #include <stdint.h>
 #include <stdio.h>
+#ifdef __linux__
+#include <pthread.h>
+#endif
 
 #define isFAT32(data) strncmp(((struct pt_fat32 *)data)->BS_FilSysType, "FAT32", 5) == 0
 #define fs_FAT32(fs)  ((struct pt_fat32 *)(fs))
@@ -14,6 +18,18 @@
 		}                                                                         \
 	}
 
+// 扇区大小取自BPB，4Kn映像上为4096
+#define FAT32_SECTOR_OFFSET(fat32, sector) ((uint64_t)(sector) * (fat32)->BPB_BytesPerSec)
+#define FAT32_CLUS_SIZE(fat32)			   ((uint32_t)(fat32)->BPB_BytesPerSec * (fat32)->BPB_SecPerClus)
+#define FAT32_CLUS_SECTOR(fat32, clus)	   ((fat32)->data_start + ((clus) - 2) * (fat32)->BPB_SecPerClus)
+#define FAT32_CLUS_OFFSET(fat32, clus)	   FAT32_SECTOR_OFFSET(fat32, FAT32_CLUS_SECTOR(fat32, clus))
+
+#define FAT32_DATE(tm) (((tm)->tm_year - 80) << 9 | ((tm)->tm_mon + 1) << 5 | (tm)->tm_mday)
+#define FAT32_TIME(tm) ((tm)->tm_hour << 11 | (tm)->tm_min << 5 | (tm)->tm_sec >> 1)
+
+#define FAT32_TIME_MIN 315532800LL  // 1980-01-01 00:00:00 UTC，目录项能表示的最早时间
+#define FAT32_TIME_MAX 4354819198LL // 2107-12-31 23:59:58 UTC，目录项能表示的最晚时间
+
 #define FAT32_ATTR_READ_ONLY 0x01
 #define FAT32_ATTR_HIDDEN	 0x02
 #define FAT32_ATTR_SYSTEM	 0x04
@@ -22,6 +38,15 @@
 #define FAT32_ATTR_ARCHIVE	 0x20
 #define FAT32_ATTR_LONG_NAME 0x0f
 
+#define FAT32_RSVD_SECTORS	32			  // mkfs创建的保留扇区数
+#define FAT32_MAX_FILE_SIZE 0xffffffffULL // 目录项中的文件大小只有32位
+#define FAT32_BOOT_SIZE		512			  // 引导扇区和FSInfo结构的大小，与扇区大小无关
+#define FAT32_MAX_SECTOR	4096		  // 支持的最大扇区大小
+#define FAT32_WRITE_BOUNCE	(64 * 1024)	  // 不超过这个大小的文件末尾数据补0后一次写入
+
+#define FAT32_ALLOC_DATA 1 // fat32_map分配的新簇不清零
+#define FAT32_ALLOC_ZERO 2 // fat32_map分配的新簇清零
+
 #define FAT32_BASE_L 0x08
 #define FAT32_EXT_L	 0x10
 
@@ -73,6 +98,18 @@ struct pt_fat32 {
 	unsigned int fat_start;
 	unsigned int data_start;
 
+	uint32_t *fat;		// 内存中的FAT表(第一个FAT)
+	uint8_t *fat_dirty; // 每个FAT扇区一个脏标记，卸载时写回
+	uint8_t fat_mapped; // fat直接指向映像中的第一个FAT
+	uint32_t fat_entries;
+
+	uint64_t *free_map; // 空闲簇位图，置1表示空闲
+	uint32_t free_count, next_free;
+	uint8_t fsinfo_stale; // 挂载时FSInfo中的空闲簇数与FAT不符
+	uint8_t *bounce;	  // FAT32_WRITE_BOUNCE字节，用于合并文件末尾的数据和补0的扇区
+
+	struct fat32_dir_index **dir_index; // 目录索引，按目录的第一个簇分散到FAT32_INDEX_SLOTS个链表
+
 } __attribute__((packed));
 
 struct FAT_clus_list {
@@ -81,6 +118,37 @@ struct FAT_clus_list {
 	struct FAT_clus_list *next;
 };
 
+#define FAT32_INDEX_SLOTS 256
+#define FAT32_READAHEAD	  16 // 扫描目录时一次最多预读的簇数
+#define FAT32_NAME_MAX	  (255 * 3 + 1) // UTF-8编码的长文件名最大长度
+
+// 目录索引中的一个文件，名称都已转换为小写
+struct fat32_index_entry {
+	char *name, *short_name;
+	uint32_t lhash, shash;
+	uint32_t offset; // 短目录项在目录中的偏移
+	uint32_t first;	 // 第一个长目录项在目录中的偏移，没有长文件名时等于offset
+	uint32_t clus;
+	uint8_t attr;
+	struct fat32_index_entry *lnext, *snext; // 长文件名和短文件名的哈希链
+};
+
+struct fat32_dir_index {
+	uint32_t clus;			// 目录的第一个簇
+	uint32_t end;			// 新目录项从这里追加
+	uint32_t count, hash_size;
+	struct fat32_index_entry **lhash, **shash;
+	struct fat32_dir_index *next;
+};
+
+struct fat32_dir_iter {
+	struct fnode *dir;
+	uint32_t offset; // 下一个目录项在目录中的偏移
+	uint32_t index;	 // data中是目录的第几个簇
+	uint32_t ra_end; // 已经预读到目录的第几个簇
+	uint8_t *data, *buf;
+};
+
 #pragma pack(1)
 struct FAT32_dir {
 	unsigned char DIR_Name[8];
@@ -110,29 +178,149 @@ struct FAT32_long_dir {
 	unsigned short LDIR_Name3[2];
 } __attribute__((packed));
 
+struct fat32_dirent {
+	char name[FAT32_NAME_MAX];
+	char short_name[13];
+	uint32_t offset, first;
+	struct FAT32_dir sdir;
+};
+
+// 解析目录项时暂存的长文件名
+struct fat32_lfn_state {
+	uint16_t lname[20 * 13];
+	int expect, cnt; // 下一个长目录项的序号和长目录项总数，expect为-1时没有有效的长文件名
+	uint8_t checksum;
+	uint32_t first;
+};
+
+#define FSCK_BAD_START 0
+#define FSCK_BAD_LINK  1
+#define FSCK_LOOP	   2
+#define FSCK_CROSS	   3
+#define FSCK_LONG	   4
+#define FSCK_SIZE	   5
+#define FSCK_DIR_SIZE  6
+
+#define FAT32_FSCK_FAT_CHUNK 2048 // 比较FAT副本时每次读入的扇区数
+
+// 检查分区时发现的一个问题
+struct fat32_fsck_problem {
+	int type;
+	char *path;
+	uint64_t dirent; // 短目录项在映像中的偏移
+	uint32_t id;	 // 簇链的编号
+	uint32_t last;	 // 截断簇链时保留的最后一个簇，0表示清除整个目录项
+	uint32_t size;	 // 修复后的文件大小
+	struct fat32_fsck_problem *next;
+};
+
+// 等待扫描的目录，从clus开始的count个簇都已检查过
+struct fat32_fsck_dir {
+	char *path;
+	uint32_t clus, count;
+	struct fat32_fsck_dir *next;
+};
+
+struct fat32_fsck {
+	struct ffi *ffi;
+	FILE *fp;
+	partition_t *part;
+	struct pt_fat32 *fat32;
+	uint32_t *owner; // 每个簇所属簇链的编号，0表示不属于任何簇链
+	uint32_t next_id;
+	struct fat32_fsck_dir *dirs;
+	uint32_t active; // 正在扫描目录的线程数
+	struct fat32_fsck_problem *problems;
+	uint32_t nproblem;
+	uint32_t dir_count, file_count;
+#ifdef __linux__
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+};
+
+#define FAT32_DEFRAG_CHUNK (4 * 1024 * 1024) // 碎片整理时每次复制的大小
+
+// 碎片整理时记录的一个有碎片的文件
+struct fat32_defrag_file {
+	uint64_t dirent; // 短目录项在映像中的偏移
+	uint32_t start, count;
+};
+
+// 分区的碎片情况
+struct fat32_frag_report {
+	uint32_t files, fragmented;
+	uint32_t clusters, extents; // 文件占用的簇数和连续区间数
+	uint32_t free_runs, largest_free;
+};
+
+struct fat32_defrag {
+	struct ffi *ffi;
+	FILE *fp;
+	partition_t *part;
+	struct pt_fat32 *fat32;
+	uint64_t *visited; // 已扫描过的目录，按第一个簇标记
+	struct fat32_defrag_file *files;
+	uint32_t nfile, cap;
+};
+
+// fsi->diropen返回的句柄
+struct fat32_readdir {
+	struct fat32_dir_iter it;
+	struct fat32_dirent ent;
+};
+
 int fat32_check(struct ffi *ffi, FILE *fp, struct partition *pt);
 int fat32_readsuperblock(struct ffi *ffi, FILE *fp, struct _partition_s *partition);
 struct fnode *FAT32_open(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
 						 char *filename);
-void FAT32_close(struct fnode *fnode);
+void FAT32_close(struct ffi *ffi, FILE *fp, struct fnode *fnode);
+void FAT32_flush(struct ffi *ffi, FILE *fp, struct fnode *fnode);
 void FAT32_read(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint8_t *buffer, uint32_t length);
 void FAT32_write(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint8_t *buffer, uint32_t length);
+int FAT32_prealloc(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint64_t size);
+void FAT32_truncate(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint64_t size);
 struct fnode *FAT32_mkdir(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
 						  char *name, int len);
 struct fnode *FAT32_create_file(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
 								char *name, int len);
-struct fnode *FAT32_create_dir(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
-							   char *name, int len, int type);
 void FAT32_delete_file(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *fnode);
-void FAT32_close(struct fnode *fnode);
+void fat32_zero(struct ffi *ffi, FILE *fp, partition_t *part, uint64_t offset, uint64_t size);
 int fat32_alloc_clus(struct ffi *ffi, FILE *fp, partition_t *part, int last_clus, int first);
+uint32_t fat32_alloc_run(struct _partition_s *part, uint32_t last_clus, uint32_t want, uint32_t *got);
 int fat32_free_clus(struct ffi *ffi, FILE *fp, partition_t *part, int last_clus, int clus);
 uint32_t find_member_in_fat(struct ffi *ffi, FILE *fp, struct _partition_s *part, uint32_t i);
+void fat32_set_member(struct _partition_s *part, uint32_t i, uint32_t value);
+int fat32_load_fat(struct ffi *ffi, FILE *fp, struct _partition_s *part);
+void fat32_flush_fat(struct ffi *ffi, FILE *fp, struct _partition_s *part);
+void FAT32_umount(struct ffi *ffi, FILE *fp, struct _partition_s *part);
+int fat32_mkfs(struct ffi *ffi, FILE *fp, uint32_t start, uint32_t sectors, uint32_t clus_size,
+			   uint32_t sector_size);
+int fat32_fsck(struct ffi *ffi, FILE *fp, struct _partition_s *part, int repair, int jobs);
+int fat32_defrag(struct ffi *ffi, FILE *fp, struct _partition_s *part);
+uint32_t fat32_next_free(struct pt_fat32 *fat32, uint32_t start);
+uint32_t fat32_scan_zero(const uint32_t *v, uint32_t n, uint32_t mask, uint64_t *map);
+uint32_t fat32_bitmap_run(const uint64_t *map, uint32_t start, uint32_t end);
+uint8_t *fat32_read_clus(struct ffi *ffi, FILE *fp, struct _partition_s *part, uint32_t clus, uint8_t *buf);
 struct fnode *FAT32_open_dir(struct ffi *ffi, FILE *fp, struct _partition_s *part, char *path);
 struct fnode *FAT32_find_dir(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
 							 char *name);
-uint32_t fat_next(struct ffi *ffi, FILE *fp, struct _partition_s *part, uint32_t clus, int next, int alloc);
-void FAT32_seek(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint32_t offset, int fromwhere);
+uint32_t fat32_map(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint32_t lclus, int alloc, uint32_t *run);
+uint64_t fat32_dirent_pos(struct ffi *ffi, FILE *fp, struct fnode *dir, uint32_t offset);
+void fat32_dir_open(struct fat32_dir_iter *it, struct fnode *dir);
+int fat32_decode_entry(struct fat32_lfn_state *st, const uint8_t *e, uint32_t offset, struct fat32_dirent *ent);
+int fat32_dir_next(struct ffi *ffi, FILE *fp, struct fat32_dir_iter *it, struct fat32_dirent *ent);
+void fat32_dir_close(struct fat32_dir_iter *it);
+time_t fat32_time(uint16_t date, uint16_t tm);
+time_t FAT32_clamp_time(time_t t);
+void *FAT32_diropen(struct ffi *ffi, FILE *fp, struct fnode *dir);
+int FAT32_readdir(struct ffi *ffi, FILE *fp, void *handle, struct fs_dirent *ent);
+void FAT32_dirclose(void *handle);
+int FAT32_stat(struct ffi *ffi, FILE *fp, struct fnode *fnode, struct fs_stat *st);
+int FAT32_get_runs(struct ffi *ffi, FILE *fp, struct fnode *fnode, struct fs_run **runs);
+struct fat32_dir_index *fat32_index_get(struct ffi *ffi, FILE *fp, struct fnode *dir);
+void fat32_index_free(struct _partition_s *part);
+void FAT32_seek(struct ffi *ffi, FILE *fp, struct fnode *fnode, int64_t offset, int fromwhere);
 uint8_t FAT32_get_attr(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *fnode);
 void FAT32_set_attr(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *fnode, uint8_t attr);
 
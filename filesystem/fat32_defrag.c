@@ -0,0 +1,214 @@
+#include "../ff.h"
+#include "../fs.h"
+#include "fat32.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define DIV_ROUND_UP(x, step) ((x + step - 1) / (step))
+
+#define MAP_TEST(map, i) ((map)[(i) / 64] >> ((i) % 64) & 1)
+#define MAP_SET(map, i)	 ((map)[(i) / 64] |= 1ULL << ((i) % 64))
+
+/**
+ * 返回从clus开始的簇链的簇数，*extents返回其中连续区间的个数
+ * 最多走fat_entries个簇，簇链有环时也能结束
+ */
+static uint32_t defrag_chain(struct pt_fat32 *fat32, uint32_t clus, uint32_t *extents) {
+	uint32_t n = 0, next;
+
+	*extents = 0;
+	while (clus >= 2 && clus < fat32->fat_entries && n < fat32->fat_entries) {
+		n++;
+		next = fat32->fat[clus] & 0x0fffffff;
+		if (next != clus + 1) (*extents)++;
+		clus = next;
+	}
+	return n;
+}
+
+static void defrag_add(struct fat32_defrag *d, uint64_t dirent, uint32_t start, uint32_t count) {
+	if (d->nfile == d->cap) {
+		d->cap	 = MAX(d->cap * 2, 64);
+		d->files = realloc(d->files, d->cap * sizeof(struct fat32_defrag_file));
+	}
+	d->files[d->nfile].dirent  = dirent;
+	d->files[d->nfile].start   = start;
+	d->files[d->nfile++].count = count;
+}
+
+/**
+ * 从根目录开始遍历所有目录，统计文件的簇数和连续区间数以及空闲空间的分布
+ * collect为1时记录有碎片的文件，目录直接从映像读取，调用前应写回块缓存
+ */
+static void defrag_scan(struct fat32_defrag *d, struct fat32_frag_report *r, int collect) {
+	struct pt_fat32 *fat32	 = d->fat32;
+	uint32_t clus_size		 = FAT32_CLUS_SIZE(fat32);
+	uint32_t words			 = DIV_ROUND_UP(fat32->fat_entries, 64);
+	uint8_t *buf			 = malloc(clus_size);
+	struct fat32_dirent *ent = malloc(sizeof(struct fat32_dirent));
+	uint32_t *stack, top = 0, cap = 64, dir, clus, start, n, ext, i, off;
+	struct fat32_lfn_state st;
+	uint64_t addr;
+	int ret;
+
+	memset(r, 0, sizeof(struct fat32_frag_report));
+	memset(d->visited, 0, words * sizeof(uint64_t));
+	stack		 = malloc(cap * sizeof(uint32_t));
+	stack[top++] = fat32->BPB_RootClus;
+	MAP_SET(d->visited, fat32->BPB_RootClus);
+	while (top > 0) {
+		dir		  = stack[--top];
+		st.expect = -1;
+		ret		  = 0;
+		for (i = 0, clus = dir; clus >= 2 && clus < fat32->fat_entries && i < fat32->fat_entries && ret >= 0;
+			 i++, clus = fat32->fat[clus] & 0x0fffffff) {
+			addr = FAT32_CLUS_OFFSET(fat32, clus);
+			d->ffi->pread(d->fp, buf, clus_size, addr);
+			for (off = 0; off < clus_size; off += 32) {
+				ret = fat32_decode_entry(&st, buf + off, i * clus_size + off, ent);
+				if (ret < 0) break;
+				if (ret == 0 || strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0) continue;
+				start = (uint32_t)ent->sdir.DIR_FstClusHI << 16 | ent->sdir.DIR_FstClusLO;
+				if (start < 2 || start >= fat32->fat_entries) continue;
+				if (ent->sdir.DIR_Attr & FAT32_ATTR_DIRECTORY) {
+					if (MAP_TEST(d->visited, start)) continue;
+					MAP_SET(d->visited, start);
+					if (top == cap) stack = realloc(stack, (cap *= 2) * sizeof(uint32_t));
+					stack[top++] = start;
+					continue;
+				}
+				n = defrag_chain(fat32, start, &ext);
+				r->files++;
+				r->clusters += n;
+				r->extents += ext;
+				if (ext <= 1) continue;
+				r->fragmented++;
+				if (collect) defrag_add(d, addr + off, start, n);
+			}
+		}
+	}
+	for (i = fat32_next_free(fat32, 2); i < fat32->fat_entries; i = fat32_next_free(fat32, i + n)) {
+		n = fat32_bitmap_run(fat32->free_map, i, fat32->fat_entries);
+		r->free_runs++;
+		r->largest_free = MAX(r->largest_free, n);
+	}
+	free(stack);
+	free(ent);
+	free(buf);
+}
+
+static void defrag_print(const char *when, struct fat32_frag_report *r) {
+	printf("%s: %u files, %u fragmented (%.1f%%), %u clusters in %u extents, free space in %u runs (largest %u "
+		   "clusters)\n",
+		   when, r->files, r->fragmented, r->files > 0 ? 100.0 * r->fragmented / r->files : 0.0, r->clusters,
+		   r->extents, r->free_runs, r->largest_free);
+}
+
+/**
+ * 把文件f的簇链复制到一段连续的空闲簇，再修改目录项中的第一个簇并释放原来的簇链
+ * 找不到足够长的连续空闲区时不移动，返回-1
+ */
+static int defrag_move(struct fat32_defrag *d, struct fat32_defrag_file *f, uint8_t *buf) {
+	struct pt_fat32 *fat32 = d->fat32;
+	uint32_t clus_size	   = FAT32_CLUS_SIZE(fat32);
+	uint32_t chunk		   = MAX(FAT32_DEFRAG_CHUNK / clus_size, 1);
+	uint32_t dst, got, src, len, done, next, i;
+	uint64_t from, to;
+	struct FAT32_dir sdir;
+
+	// 每次都从分区开头查找，文件尽量集中在分区前部
+	fat32->next_free = 2;
+	dst				 = fat32_alloc_run(d->part, 0, f->count, &got);
+	if (dst == 0) return -1;
+	if (got < f->count) {
+		for (i = dst; i < dst + got; i++)
+			fat32_set_member(d->part, i, 0);
+		return -1;
+	}
+
+	// 原簇链中连续的一段一次复制，最多chunk个簇
+	for (src = f->start, done = 0; done < f->count; src = next, done += len) {
+		for (len = 1; len < MIN(chunk, f->count - done) && (fat32->fat[src + len - 1] & 0x0fffffff) == src + len;
+			 len++)
+			;
+		next = fat32->fat[src + len - 1] & 0x0fffffff;
+		from = FAT32_CLUS_OFFSET(fat32, src);
+		to	 = FAT32_CLUS_OFFSET(fat32, dst + done);
+		bcache_invalidate(d->part->cache, from, (uint64_t)len * clus_size);
+		bcache_invalidate(d->part->cache, to, (uint64_t)len * clus_size);
+		d->ffi->pread(d->fp, buf, len * clus_size, from);
+		d->ffi->pwrite(d->fp, buf, len * clus_size, to);
+	}
+
+	bcache_read(d->part->cache, (uint8_t *)&sdir, sizeof(struct FAT32_dir), f->dirent);
+	sdir.DIR_FstClusHI = dst >> 16;
+	sdir.DIR_FstClusLO = dst & 0xffff;
+	bcache_write(d->part->cache, (uint8_t *)&sdir, sizeof(struct FAT32_dir), f->dirent);
+
+	for (src = f->start, i = 0; i < f->count; src = next, i++) {
+		next = fat32->fat[src] & 0x0fffffff;
+		fat32_set_member(d->part, src, 0);
+	}
+	return 0;
+}
+
+static int defrag_cmp(const void *a, const void *b) {
+	uint32_t x = ((struct fat32_defrag_file *)a)->count, y = ((struct fat32_defrag_file *)b)->count;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * 碎片整理：找出簇链不连续的文件，按大小从小到大依次移到分区中第一段足够长的连续空闲簇，
+ * 前面的文件释放的簇可以给后面的文件使用，整理前后各输出一次碎片情况，返回移动的文件数
+ * 目录不移动，分区应当先用check检查
+ */
+int fat32_defrag(struct ffi *ffi, FILE *fp, struct _partition_s *part) {
+	struct pt_fat32 *fat32 = part->private_data;
+	uint32_t clus_size	   = FAT32_CLUS_SIZE(fat32);
+	struct fat32_frag_report r;
+	struct fat32_defrag d;
+	uint32_t i, moved = 0, clusters = 0;
+	uint8_t *buf;
+
+	memset(&d, 0, sizeof(d));
+	d.ffi	  = ffi;
+	d.fp	  = fp;
+	d.part	  = part;
+	d.fat32	  = fat32;
+	d.visited = malloc(DIV_ROUND_UP(fat32->fat_entries, 64) * sizeof(uint64_t));
+	buf		  = malloc(MAX(FAT32_DEFRAG_CHUNK / clus_size, 1) * clus_size);
+	if (d.visited == NULL || buf == NULL) {
+		free(d.visited);
+		free(buf);
+		return -1;
+	}
+	bcache_flush(part->cache); // 之后直接从映像读取目录
+
+	defrag_scan(&d, &r, 1);
+	defrag_print("Before", &r);
+	if (d.nfile > 0) qsort(d.files, d.nfile, sizeof(struct fat32_defrag_file), defrag_cmp);
+	for (i = 0; i < d.nfile; i++) {
+		if (defrag_move(&d, &d.files[i], buf) != 0) continue;
+		moved++;
+		clusters += d.files[i].count;
+	}
+	printf("Moved %u files (%u clusters), %u skipped for lack of contiguous free space\n", moved, clusters,
+		   d.nfile - moved);
+	if (moved > 0) {
+		// 目录项已经改变，丢弃按旧内容建立的索引和打开的目录
+		fat32_index_free(part);
+		dcache_free(part, ffi, fp);
+	}
+
+	bcache_flush(part->cache);
+	defrag_scan(&d, &r, 0);
+	defrag_print("After", &r);
+
+	free(d.files);
+	free(d.visited);
+	free(buf);
+	return moved;
+}
\ No newline at end of file
@@ -0,0 +1,368 @@
+#include "../ff.h"
+#include "../fs.h"
+#include "fat32.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define DIV_ROUND_UP(x, step) ((x + step - 1) / (step))
+
+#ifdef __linux__
+#define fsck_lock(c)   pthread_mutex_lock(&(c)->lock)
+#define fsck_unlock(c) pthread_mutex_unlock(&(c)->lock)
+#else
+#define fsck_lock(c)
+#define fsck_unlock(c)
+#endif
+
+static const char *fsck_messages[] = {
+	[FSCK_BAD_START] = "invalid first cluster",
+	[FSCK_BAD_LINK]	 = "cluster chain points to a free or invalid cluster",
+	[FSCK_LOOP]		 = "cluster chain loops back on itself",
+	[FSCK_CROSS]	 = "cross-linked with another file",
+	[FSCK_LONG]		 = "cluster chain longer than file size",
+	[FSCK_SIZE]		 = "file size larger than cluster chain",
+	[FSCK_DIR_SIZE]	 = "directory has non-zero size",
+};
+
+static void fsck_problem(struct fat32_fsck *c, int type, const char *path, uint64_t dirent, uint32_t id,
+						 uint32_t last, uint32_t size) {
+	struct fat32_fsck_problem *p = malloc(sizeof(struct fat32_fsck_problem));
+
+	p->type	  = type;
+	p->path	  = strdup(path);
+	p->dirent = dirent;
+	p->id	  = id;
+	p->last	  = last;
+	p->size	  = size;
+	fsck_lock(c);
+	p->next		= c->problems;
+	c->problems = p;
+	c->nproblem++;
+	fsck_unlock(c);
+}
+
+/**
+ * 沿簇链最多走max个簇，把途经的簇标记为属于编号为id的簇链，返回有效的簇数，*last返回最后一个有效的簇
+ * 遇到已属于其他簇链的簇、回到本簇链或指向空闲和无效的簇时停止，*bad返回问题类型，没有问题时为-1
+ * 走完max个簇后簇链还没有结束时为FSCK_LONG，多出的簇不标记，属于其他文件时不会被当成交叉链接
+ * 簇的归属用原子操作标记，多个线程可以同时检查不同的簇链
+ */
+static uint32_t fsck_walk(struct fat32_fsck *c, uint32_t clus, uint32_t id, uint32_t max, uint32_t *last,
+						  int *bad) {
+	struct pt_fat32 *fat32 = c->fat32;
+	uint32_t n = 0, owner, next;
+
+	*last = 0;
+	*bad  = -1;
+	for (;;) {
+		owner = 0;
+		if (!__atomic_compare_exchange_n(&c->owner[clus], &owner, id, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			*bad = owner == id ? FSCK_LOOP : FSCK_CROSS;
+			return n;
+		}
+		n++;
+		*last = clus;
+		next  = fat32->fat[clus] & 0x0fffffff;
+		if (next >= 0x0ffffff8) return n;
+		if (n == max) {
+			*bad = FSCK_LONG;
+			return n;
+		}
+		if (next < 2 || next >= fat32->fat_entries || (fat32->fat[next] & 0x0fffffff) == 0) {
+			*bad = FSCK_BAD_LINK;
+			return n;
+		}
+		clus = next;
+	}
+}
+
+static int fsck_cmp(const void *a, const void *b) {
+	const struct fat32_fsck_problem *x = *(struct fat32_fsck_problem **)a;
+	const struct fat32_fsck_problem *y = *(struct fat32_fsck_problem **)b;
+	int r							   = strcmp(x->path, y->path);
+
+	return r != 0 ? r : x->type - y->type;
+}
+
+static void fsck_push_dir(struct fat32_fsck *c, const char *path, uint32_t clus, uint32_t count) {
+	struct fat32_fsck_dir *d = malloc(sizeof(struct fat32_fsck_dir));
+
+	d->path	 = strdup(path);
+	d->clus	 = clus;
+	d->count = count;
+	fsck_lock(c);
+	d->next = c->dirs;
+	c->dirs = d;
+#ifdef __linux__
+	pthread_cond_signal(&c->cond);
+#endif
+	fsck_unlock(c);
+}
+
+// 检查目录中的一个文件或子目录，pos是短目录项在映像中的偏移，子目录加入待扫描的队列
+static void fsck_entry(struct fat32_fsck *c, const char *dir, struct fat32_dirent *ent, uint64_t pos) {
+	struct pt_fat32 *fat32 = c->fat32;
+	uint32_t clus_size	   = FAT32_CLUS_SIZE(fat32);
+	struct FAT32_dir *sdir = &ent->sdir;
+	uint32_t start		   = (uint32_t)sdir->DIR_FstClusHI << 16 | sdir->DIR_FstClusLO;
+	int is_dir			   = (sdir->DIR_Attr & FAT32_ATTR_DIRECTORY) != 0;
+	uint32_t id, n, need, last;
+	char *path;
+	int bad;
+
+	path = malloc(strlen(dir) + strlen(ent->name) + 2);
+	sprintf(path, "%s/%s", dir, ent->name);
+	if (is_dir) __atomic_add_fetch(&c->dir_count, 1, __ATOMIC_RELAXED);
+	else __atomic_add_fetch(&c->file_count, 1, __ATOMIC_RELAXED);
+	if (is_dir && sdir->DIR_FileSize != 0) fsck_problem(c, FSCK_DIR_SIZE, path, pos, 0, 0, 0);
+
+	if (start == 0) {
+		if (is_dir) fsck_problem(c, FSCK_BAD_START, path, pos, 0, 0, 0);
+		else if (sdir->DIR_FileSize != 0) fsck_problem(c, FSCK_SIZE, path, pos, 0, 0, 0);
+		free(path);
+		return;
+	}
+	if (start < 2 || start >= fat32->fat_entries || (fat32->fat[start] & 0x0fffffff) == 0) {
+		fsck_problem(c, FSCK_BAD_START, path, pos, 0, 0, 0);
+		free(path);
+		return;
+	}
+
+	// 新建的空文件也分配了一个簇，不算作问题
+	need = is_dir ? UINT32_MAX : MAX(DIV_ROUND_UP(sdir->DIR_FileSize, clus_size), 1);
+	id	 = __atomic_add_fetch(&c->next_id, 1, __ATOMIC_RELAXED);
+	n	 = fsck_walk(c, start, id, need, &last, &bad);
+	if (n == 0) { // 第一个簇就属于其他簇链，整个目录项都要清除
+		fsck_problem(c, FSCK_CROSS, path, pos, id, 0, 0);
+		free(path);
+		return;
+	}
+	if (bad >= 0) fsck_problem(c, bad, path, pos, id, last, 0);
+	if (is_dir) fsck_push_dir(c, path, start, n);
+	else if (n < need) fsck_problem(c, FSCK_SIZE, path, pos, id, 0, n * clus_size);
+	free(path);
+}
+
+// 扫描一个目录的count个簇，直接从映像读取，不经过块缓存
+static void fsck_scan_dir(struct fat32_fsck *c, struct fat32_fsck_dir *d, uint8_t *buf) {
+	struct pt_fat32 *fat32	 = c->fat32;
+	uint32_t clus_size		 = FAT32_CLUS_SIZE(fat32);
+	struct fat32_dirent *ent = malloc(sizeof(struct fat32_dirent));
+	struct fat32_lfn_state st;
+	uint32_t clus = d->clus, i, off;
+	uint64_t addr;
+	int ret = 0;
+
+	st.expect = -1;
+	for (i = 0; i < d->count && ret >= 0; i++, clus = fat32->fat[clus] & 0x0fffffff) {
+		addr = FAT32_CLUS_OFFSET(fat32, clus);
+		c->ffi->pread(c->fp, buf, clus_size, addr);
+		for (off = 0; off < clus_size; off += 32) {
+			ret = fat32_decode_entry(&st, buf + off, i * clus_size + off, ent);
+			if (ret < 0) break;
+			if (ret == 0 || strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0) continue;
+			fsck_entry(c, d->path, ent, addr + off);
+		}
+	}
+	free(ent);
+}
+
+/**
+ * 工作线程从队列中取出目录扫描，子目录再放回队列，不同子树的目录和其中文件的簇链可以同时检查
+ * 队列为空且没有线程正在扫描时结束
+ */
+static void *fsck_worker(void *arg) {
+	struct fat32_fsck *c = arg;
+	uint8_t *buf		 = malloc(FAT32_CLUS_SIZE(c->fat32));
+	struct fat32_fsck_dir *d;
+
+	fsck_lock(c);
+	for (;;) {
+#ifdef __linux__
+		while (c->dirs == NULL && c->active > 0)
+			pthread_cond_wait(&c->cond, &c->lock);
+#endif
+		d = c->dirs;
+		if (d == NULL) break;
+		c->dirs = d->next;
+		c->active++;
+		fsck_unlock(c);
+
+		fsck_scan_dir(c, d, buf);
+		free(d->path);
+		free(d);
+
+		fsck_lock(c);
+		c->active--;
+#ifdef __linux__
+		if (c->active == 0 && c->dirs == NULL) pthread_cond_broadcast(&c->cond);
+#endif
+	}
+	fsck_unlock(c);
+	free(buf);
+	return NULL;
+}
+
+// 修改目录项中的第一个簇和文件大小，clear为1且是目录时删除这个目录项
+static void fsck_fix_entry(struct fat32_fsck *c, uint64_t pos, int clear, uint32_t size) {
+	struct FAT32_dir sdir;
+
+	bcache_read(c->part->cache, (uint8_t *)&sdir, sizeof(struct FAT32_dir), pos);
+	if (clear && (sdir.DIR_Attr & FAT32_ATTR_DIRECTORY)) {
+		sdir.DIR_Name[0] = 0xe5;
+	} else if (clear) {
+		sdir.DIR_FstClusHI = sdir.DIR_FstClusLO = 0;
+		sdir.DIR_FileSize						= 0;
+	} else {
+		sdir.DIR_FileSize = size;
+	}
+	bcache_write(c->part->cache, (uint8_t *)&sdir, sizeof(struct FAT32_dir), pos);
+}
+
+static void fsck_repair(struct fat32_fsck *c, struct fat32_fsck_problem *p) {
+	switch (p->type) {
+	case FSCK_BAD_START:
+		fsck_fix_entry(c, p->dirent, 1, 0);
+		break;
+	case FSCK_CROSS:
+	case FSCK_LOOP:
+	case FSCK_BAD_LINK:
+	case FSCK_LONG:
+		// 截断后不属于任何簇链的簇作为丢失的簇释放
+		if (p->last == 0) fsck_fix_entry(c, p->dirent, 1, 0);
+		else fat32_set_member(c->part, p->last, 0x0fffffff);
+		break;
+	case FSCK_SIZE:
+	case FSCK_DIR_SIZE:
+		fsck_fix_entry(c, p->dirent, 0, p->size);
+		break;
+	}
+}
+
+// 比较其余的FAT和内存中的FAT，返回不一致的扇区数，repair时标记为脏扇区，卸载时写回
+static uint32_t fsck_fat_copies(struct fat32_fsck *c, int repair) {
+	struct pt_fat32 *fat32 = c->fat32;
+	uint32_t chunk		   = MIN(fat32->BPB_FATSz32, FAT32_FSCK_FAT_CHUNK);
+	uint32_t sec		   = fat32->BPB_BytesPerSec;
+	uint8_t *buf		   = malloc(chunk * sec);
+	uint32_t k, i, j, n, diff = 0;
+
+	for (k = 1; k < fat32->BPB_NumFATs; k++) {
+		for (i = 0; i < fat32->BPB_FATSz32; i += n) {
+			n = MIN(chunk, fat32->BPB_FATSz32 - i);
+			c->ffi->pread(c->fp, buf, n * sec,
+						  FAT32_SECTOR_OFFSET(fat32, fat32->fat_start + k * fat32->BPB_FATSz32 + i));
+			for (j = 0; j < n; j++) {
+				if (memcmp(buf + j * sec, (uint8_t *)fat32->fat + (i + j) * sec, sec) == 0)
+					continue;
+				diff++;
+				if (repair) fat32->fat_dirty[i + j] = 1;
+			}
+		}
+	}
+	free(buf);
+	return diff;
+}
+
+/**
+ * 检查分区：从根目录开始遍历所有目录和簇链，找出无效或交叉的簇链、大小和簇链不符的文件、
+ * 不属于任何文件的簇以及不一致的FAT副本，repair为1时修复，返回发现的问题数
+ * 目录的扫描和簇链的检查由jobs个线程完成，修复在所有线程结束后在当前线程进行
+ */
+int fat32_fsck(struct ffi *ffi, FILE *fp, struct _partition_s *part, int repair, int jobs) {
+	struct pt_fat32 *fat32 = part->private_data;
+	struct fat32_fsck_problem *p, **list;
+	struct fat32_fsck c;
+	uint32_t i, w, n, last, lost = 0, fat_diff;
+	uint64_t *unowned, bits;
+	int bad;
+#ifdef __linux__
+	pthread_t *workers;
+	int t;
+#endif
+
+	memset(&c, 0, sizeof(c));
+	c.ffi	= ffi;
+	c.fp	= fp;
+	c.part	= part;
+	c.fat32 = fat32;
+	c.owner = calloc(fat32->fat_entries, sizeof(uint32_t));
+	if (c.owner == NULL) return -1;
+#ifdef __linux__
+	pthread_mutex_init(&c.lock, NULL);
+	pthread_cond_init(&c.cond, NULL);
+#endif
+	// 之后直接从映像读取目录和FAT副本，先写回同一次挂载中之前的修改
+	bcache_flush(part->cache);
+	fat32_flush_fat(ffi, fp, part);
+
+	c.next_id = 1;
+	n		  = fsck_walk(&c, fat32->BPB_RootClus, c.next_id, UINT32_MAX, &last, &bad);
+	if (bad >= 0) fsck_problem(&c, bad, "", 0, c.next_id, last, 0);
+	fsck_push_dir(&c, "", fat32->BPB_RootClus, n);
+
+#ifdef __linux__
+	workers = malloc(jobs * sizeof(pthread_t));
+	for (t = 0; t < jobs; t++)
+		pthread_create(&workers[t], NULL, fsck_worker, &c);
+	for (t = 0; t < jobs; t++)
+		pthread_join(workers[t], NULL);
+	free(workers);
+	pthread_cond_destroy(&c.cond);
+	pthread_mutex_destroy(&c.lock);
+#else
+	fsck_worker(&c);
+#endif
+
+	fat_diff = fsck_fat_copies(&c, repair); // 在修复改变FAT之前比较
+
+	// 各线程发现问题的顺序不固定，按路径排序后输出和修复
+	list = malloc(MAX(c.nproblem, 1) * sizeof(struct fat32_fsck_problem *));
+	for (i = 0, p = c.problems; p != NULL; p = p->next)
+		list[i++] = p;
+	qsort(list, c.nproblem, sizeof(struct fat32_fsck_problem *), fsck_cmp);
+	for (i = 0; i < c.nproblem; i++) {
+		printf("%s: %s\n", list[i]->path[0] != 0 ? list[i]->path : "/", fsck_messages[list[i]->type]);
+		if (repair) fsck_repair(&c, list[i]);
+	}
+	// 修复之后还有值却不属于任何簇链的簇就是丢失的簇，即不在空闲位图中且没有归属的簇
+	unowned = malloc(DIV_ROUND_UP(fat32->fat_entries, 64) * sizeof(uint64_t));
+	fat32_scan_zero(c.owner, fat32->fat_entries, 0xffffffff, unowned);
+	unowned[0] &= ~3ULL; // 0号和1号表项不是簇
+	for (w = 0; w < DIV_ROUND_UP(fat32->fat_entries, 64); w++) {
+		for (bits = unowned[w] & ~fat32->free_map[w]; bits != 0; bits &= bits - 1) {
+			lost++;
+			if (repair) fat32_set_member(part, w * 64 + __builtin_ctzll(bits), 0);
+		}
+	}
+	free(unowned);
+	if (lost > 0) printf("%u lost clusters\n", lost);
+	if (fat_diff > 0) printf("%u FAT sectors differ between copies\n", fat_diff);
+	// 比较的是挂载时读到的FSInfo，之后的写入造成的差别不算问题，FSInfo在卸载时总会按FAT更新
+	if (fat32->fsinfo_stale)
+		printf("FSInfo free cluster count %u does not match the FAT\n", fat32->FSInfo.FSI_Free_Count);
+
+	n = c.nproblem + (lost > 0) + (fat_diff > 0) + fat32->fsinfo_stale;
+	if (repair) fat32->fsinfo_stale = 0;
+	printf("%u directories, %u files, %u problems%s\n", c.dir_count + 1, c.file_count, n,
+		   repair && n > 0 ? ", repaired" : "");
+	if (repair && n > 0) {
+		// 目录项和簇链已经改变，丢弃按旧内容建立的索引和打开的目录
+		fat32_index_free(part);
+		dcache_free(part, ffi, fp);
+	}
+
+	for (i = 0; i < c.nproblem; i++) {
+		free(list[i]->path);
+		free(list[i]);
+	}
+	free(list);
+	free(c.owner);
+	return n;
+}
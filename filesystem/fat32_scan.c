@@ -0,0 +1,109 @@
+#include "fat32.h"
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT32_SCAN_X86
+#endif
+
+#define DIV_ROUND_UP(x, step) ((x + step - 1) / (step))
+
+/**
+ * FAT扫描：把n个32位表项中(v & mask) == 0的位置记录到位图map(每64项一个字)，返回个数
+ * 每次处理64个表项得到一个位图字，x86上按CPU支持使用AVX2或SSE2一次比较8个或4个表项，
+ * 其余平台和不足64项的末尾逐项比较
+ */
+typedef uint32_t (*fat32_scan_fn)(const uint32_t *v, uint32_t words, uint32_t mask, uint64_t *map);
+
+static uint32_t scan_zero_scalar(const uint32_t *v, uint32_t words, uint32_t mask, uint64_t *map) {
+	uint32_t w, k, count = 0;
+	uint64_t bits;
+
+	for (w = 0; w < words; w++, v += 64) {
+		bits = 0;
+		for (k = 0; k < 64; k++)
+			bits |= (uint64_t)((v[k] & mask) == 0) << k;
+		map[w] = bits;
+		count += __builtin_popcountll(bits);
+	}
+	return count;
+}
+
+#ifdef FAT32_SCAN_X86
+__attribute__((target("sse2"))) static uint32_t scan_zero_sse2(const uint32_t *v, uint32_t words, uint32_t mask,
+															   uint64_t *map) {
+	__m128i m = _mm_set1_epi32(mask), z = _mm_setzero_si128(), x;
+	uint32_t w, k, count = 0;
+	uint64_t bits;
+
+	for (w = 0; w < words; w++, v += 64) {
+		bits = 0;
+		for (k = 0; k < 16; k++) {
+			x = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)(v + k * 4)), m), z);
+			bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(x)) << (k * 4);
+		}
+		map[w] = bits;
+		count += __builtin_popcountll(bits);
+	}
+	return count;
+}
+
+__attribute__((target("avx2"))) static uint32_t scan_zero_avx2(const uint32_t *v, uint32_t words, uint32_t mask,
+															   uint64_t *map) {
+	__m256i m = _mm256_set1_epi32(mask), z = _mm256_setzero_si256(), x;
+	uint32_t w, k, count = 0;
+	uint64_t bits;
+
+	for (w = 0; w < words; w++, v += 64) {
+		bits = 0;
+		for (k = 0; k < 8; k++) {
+			x = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(v + k * 8)), m), z);
+			bits |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(x)) << (k * 8);
+		}
+		map[w] = bits;
+		count += __builtin_popcountll(bits);
+	}
+	return count;
+}
+#endif
+
+static fat32_scan_fn scan_select(void) {
+#ifdef FAT32_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return scan_zero_avx2;
+	if (__builtin_cpu_supports("sse2")) return scan_zero_sse2;
+#endif
+	return scan_zero_scalar;
+}
+
+uint32_t fat32_scan_zero(const uint32_t *v, uint32_t n, uint32_t mask, uint64_t *map) {
+	static fat32_scan_fn scan;
+	uint32_t words = n / 64, k, count;
+	uint64_t bits = 0;
+
+	if (scan == NULL) scan = scan_select();
+	count = scan(v, words, mask, map);
+	if (n % 64 == 0) return count;
+	for (k = 0; k < n % 64; k++)
+		bits |= (uint64_t)((v[words * 64 + k] & mask) == 0) << k;
+	map[words] = bits;
+	return count + __builtin_popcountll(bits);
+}
+
+/**
+ * 返回位图中从start开始连续置1的位数，最多统计到end
+ * 逐字用ctz找第一个0位，整字全1时直接跳过64位
+ */
+uint32_t fat32_bitmap_run(const uint64_t *map, uint32_t start, uint32_t end) {
+	uint32_t i = start, zero;
+	uint64_t word;
+
+	while (i < end) {
+		word = ~map[i / 64] >> (i % 64);
+		if (word != 0) {
+			zero = i + __builtin_ctzll(word);
+			return (zero < end ? zero : end) - start;
+		}
+		i += 64 - i % 64;
+	}
+	return end - start;
+}
\ No newline at end of file
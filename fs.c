@@ -3,23 +3,24 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 extern struct fsi fat32_fsi;
 
-void fs_init(struct _partition_s *p[4], struct ffi *ffi, FILE *fp, int origin) {
+void fs_init(struct _partition_s *p[4], struct ffi *ffi, FILE *fp, struct bcache *cache, uint64_t origin) {
 	int i;
 	struct fsi *fsi;
 	uint8_t *buffer = (uint8_t *)malloc(4 * sizeof(struct partition));
 	struct partition *pt;
 
-	ffi->seek(fp, 0x1be, origin);
-	ffi->read(fp, (uint8_t *)buffer, 4 * sizeof(struct partition));
+	ffi->pread(fp, (uint8_t *)buffer, 4 * sizeof(struct partition), SECTOR_OFFSET(origin) + 0x1be);
 	for (i = 0; i < 4; i++) {
-		pt = (struct partition *)(buffer + i * sizeof(struct partition));
+		p[i] = NULL;
+		pt	 = (struct partition *)(buffer + i * sizeof(struct partition));
 		if (pt->sign == 0x80 || pt->sign == 0x00) {
-			p[i] = (partition_t *)malloc(sizeof(partition_t));
+			p[i] = (partition_t *)calloc(1, sizeof(partition_t));
 			if (pt->fs_type == 0x05 || pt->fs_type == 0x0f) { // 扩展分区（不保证能用）
-				fs_init(p[i]->childs, ffi, fp, pt->start_lba);
+				fs_init(p[i]->childs, ffi, fp, cache, pt->start_lba);
 				continue;
 			} else if (fat32_fsi.check(ffi, fp, pt) == 0) {
 				fsi = &fat32_fsi;
@@ -28,9 +29,139 @@ void fs_init(struct _partition_s *p[4], struct ffi *ffi, FILE *fp, int origin) {
 				p[i] = NULL;
 				continue;
 			}
-			p[i]->start = pt->start_lba;
-			p[i]->fsi	= fsi;
-			fsi->read_superblock(ffi, fp, p[i]);
+			p[i]->start		  = pt->start_lba;
+			p[i]->sector_size = SECTOR_SIZE; // 由read_superblock按文件系统确定
+			p[i]->fsi		  = fsi;
+			p[i]->cache		  = cache;
+			if (fsi->read_superblock(ffi, fp, p[i]) != 0) {
+				free(p[i]);
+				p[i] = NULL;
+			}
+		}
+	}
+	free(buffer);
+}
+
+// 把所有分区的缓存数据写回映像并释放分区
+void fs_exit(struct _partition_s *p[4], struct ffi *ffi, FILE *fp) {
+	int i;
+	for (i = 0; i < 4; i++) {
+		if (p[i] == NULL) continue;
+		if (p[i]->fsi == NULL) {
+			fs_exit(p[i]->childs, ffi, fp);
+		} else {
+			dcache_free(p[i], ffi, fp);
+			if (p[i]->fsi->umount != NULL) p[i]->fsi->umount(ffi, fp, p[i]);
+		}
+		free(p[i]);
+		p[i] = NULL;
+	}
+}
+
+/**
+ * 在空映像上创建MBR分区表和一个占满整个映像的FAT32主分区
+ * clus_size为0时按分区大小选择簇大小，只写入元数据，数据区保持稀疏
+ * sectors和分区表中的位置都以sector_size字节的扇区为单位，4Kn映像的扇区为4096字节
+ */
+int fs_mkfs(struct ffi *ffi, FILE *fp, uint64_t sectors, uint32_t clus_size, uint32_t sector_size) {
+	uint8_t *mbr;
+	struct partition pt;
+	uint32_t start = MKFS_PART_OFFSET / sector_size; // 分区表以映像的扇区为单位
+
+	if (sectors <= start) return -1;
+	// MBR也按整扇区写入，4Kn映像上第一个扇区的其余部分是0
+	mbr = calloc(1, sector_size);
+	memset(&pt, 0, sizeof(struct partition));
+	pt.sign		 = 0x00;
+	pt.fs_type	 = 0x0c; // FAT32(LBA)
+	pt.start_lba = start;
+	pt.size		 = sectors - start > 0xffffffff ? 0xffffffff : sectors - start;
+	memset(pt.start_chs, 0xff, 3); // 只使用LBA
+	memset(pt.end_chs, 0xff, 3);
+	pt.start_chs[0] = 0xfe;
+	pt.end_chs[0]	= 0xfe;
+	// 分区表项在MBR中不是4字节对齐的，在局部变量中填好再复制
+	memcpy(mbr + 0x1be, &pt, sizeof(struct partition));
+	mbr[510] = 0x55;
+	mbr[511] = 0xaa;
+	if (fat32_fsi.mkfs(ffi, fp, pt.start_lba, pt.size, clus_size, sector_size) != 0) {
+		free(mbr);
+		return -1;
+	}
+	ffi->pwrite(fp, mbr, sector_size, 0);
+	free(mbr);
+	return 0;
+}
+
+static uint32_t dcache_hash(const char *path, int len) {
+	uint32_t h = 2166136261u;
+	while (len-- > 0)
+		h = (h ^ (uint8_t)*path++) * 16777619u;
+	return h;
+}
+
+// 查找分区内路径为path的前len个字符的目录，不在缓存中时返回NULL
+struct fnode *dcache_lookup(partition_t *part, const char *path, int len) {
+	struct dentry *d;
+	uint32_t h;
+
+	if (part->dcache == NULL) return NULL;
+	h = dcache_hash(path, len);
+	for (d = part->dcache[h & (part->dcache_size - 1)]; d != NULL; d = d->next) {
+		if (d->hash == h && strncmp(d->path, path, len) == 0 && d->path[len] == 0) return d->fnode;
+	}
+	return NULL;
+}
+
+/**
+ * 把打开的目录加入缓存，之后由缓存持有fnode，在fs_exit时关闭
+ * 平均每个哈希链超过一项时扩大一倍
+ */
+void dcache_insert(partition_t *part, const char *path, int len, struct fnode *fnode) {
+	struct dentry *d, *next, **hash;
+	uint32_t i, size;
+
+	if (part->dcache == NULL) {
+		part->dcache_size = 64;
+		part->dcache	  = calloc(part->dcache_size, sizeof(struct dentry *));
+	} else if (part->dcache_count >= part->dcache_size) {
+		size = part->dcache_size * 2;
+		hash = calloc(size, sizeof(struct dentry *));
+		for (i = 0; i < part->dcache_size; i++) {
+			for (d = part->dcache[i]; d != NULL; d = next) {
+				next					   = d->next;
+				d->next					   = hash[d->hash & (size - 1)];
+				hash[d->hash & (size - 1)] = d;
+			}
+		}
+		free(part->dcache);
+		part->dcache	  = hash;
+		part->dcache_size = size;
+	}
+	d				= malloc(sizeof(struct dentry));
+	d->path			= strndup(path, len);
+	d->hash			= dcache_hash(path, len);
+	d->fnode		= fnode;
+	i				= d->hash & (part->dcache_size - 1);
+	d->next			= part->dcache[i];
+	part->dcache[i] = d;
+	part->dcache_count++;
+}
+
+void dcache_free(partition_t *part, struct ffi *ffi, FILE *fp) {
+	struct dentry *d, *next;
+	uint32_t i;
+
+	if (part->dcache == NULL) return;
+	for (i = 0; i < part->dcache_size; i++) {
+		for (d = part->dcache[i]; d != NULL; d = next) {
+			next = d->next;
+			part->fsi->close(ffi, fp, d->fnode);
+			free(d->path);
+			free(d);
 		}
 	}
+	free(part->dcache);
+	part->dcache	  = NULL;
+	part->dcache_size = part->dcache_count = 0;
 }
\ No newline at end of file
@@ -2,30 +2,83 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
+#include "cache.h"
 #include "ff.h"
 
-#define SECTOR_SIZE 512
+#define SECTOR_SIZE 512 // 分区表所在扇区的大小，也是mkfs默认的扇区大小
+
+#define SECTOR_OFFSET(sector) ((uint64_t)(sector) * SECTOR_SIZE) // 扇区号对应的字节偏移，映像可以大于4GB
+
+#define MKFS_PART_OFFSET (1024 * 1024) // mkfs创建的分区从1MiB处开始
 
 typedef struct _partition_s {
 	char *name;
 	struct fnode *root;
-	int start;
+	uint64_t start;		  // 分区的第一个扇区
+	uint32_t sector_size; // 分区的扇区大小，start和分区表都以它为单位
 	void *private_data;
 	struct fsi *fsi;
+	struct bcache *cache; // 所有分区共用的块缓存
+	struct dentry **dcache;			// 已打开目录的缓存，按分区内的完整路径查找
+	uint32_t dcache_size, dcache_count;
 	struct _partition_s *childs[4]; // 为扩展分区预留
 } partition_t;
 
+struct dentry {
+	char *path; // 不含首尾的'/'
+	uint32_t hash;
+	struct fnode *fnode;
+	struct dentry *next;
+};
+
+// 文件内从第lclus个簇开始的len个簇，在分区中从pclus开始连续存放
+struct extent {
+	uint32_t lclus, pclus, len;
+};
+
 struct fnode {
 	char *name;
-	uint32_t pos, dir_offset, size;
-	uint32_t offset;
+	uint32_t pos, dir_offset;
+	uint64_t size, offset;
+	struct extent *extents; // 按需建立的簇区间表，按lclus升序排列
+	uint32_t extent_cnt, extent_max;
+	time_t mtime; // 最后修改时间，dirty时在flush/close时写回目录项
+	int dirty;
 	struct fnode *parent;
 	struct fnode *child;
 	struct fnode *next;
 	partition_t *part;
 };
 
+#define FS_NAME_MAX (255 * 3 + 1) // UTF-8编码的文件名最大长度
+
+// readdir读出的一个文件，不含"."和".."
+struct fs_dirent {
+	char name[FS_NAME_MAX];
+	int is_dir;
+	uint8_t attr;
+	uint64_t size;
+	time_t mtime;
+};
+
+// 文件或目录的详细信息，块即文件系统的分配单位
+struct fs_stat {
+	uint64_t size;
+	uint8_t attr;
+	time_t mtime;
+	uint32_t block_size;
+	uint32_t blocks, extents; // 占用的块数和其中连续区间的个数
+	uint32_t first_block;
+};
+
+// 文件数据在映像中的一段连续区间
+struct fs_run {
+	uint64_t offset; // 映像中的字节偏移
+	uint32_t length;
+};
+
 struct partition {
 	uint8_t sign;
 	uint8_t start_chs[3];
@@ -41,10 +94,13 @@ struct fsi {
 	struct fnode *(*open)(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
 						  char *filename);
 	struct fnode *(*opendir)(struct ffi *ffi, FILE *fp, struct _partition_s *part, char *path);
-	void (*close)(struct fnode *fnode);
-	void (*seek)(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint32_t offset, int fromwhere);
+	void (*close)(struct ffi *ffi, FILE *fp, struct fnode *fnode);
+	void (*flush)(struct ffi *ffi, FILE *fp, struct fnode *fnode);
+	void (*seek)(struct ffi *ffi, FILE *fp, struct fnode *fnode, int64_t offset, int fromwhere);
 	void (*read)(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint8_t *buffer, uint32_t length);
 	void (*write)(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint8_t *buffer, uint32_t length);
+	int (*prealloc)(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint64_t size);
+	void (*truncate)(struct ffi *ffi, FILE *fp, struct fnode *fnode, uint64_t size);
 	struct fnode *(*createfile)(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *parent,
 								char *name, int len);
 	void (*delete)(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *fnode);
@@ -52,6 +108,26 @@ struct fsi {
 						   char *name, int len);
 	uint8_t (*get_attr)(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *fnode);
 	void (*set_attr)(struct ffi *ffi, FILE *fp, struct _partition_s *part, struct fnode *fnode, uint8_t attr);
+	// 按顺序遍历目录，diropen返回的句柄交给readdir，到达末尾时readdir返回0
+	void *(*diropen)(struct ffi *ffi, FILE *fp, struct fnode *dir);
+	int (*readdir)(struct ffi *ffi, FILE *fp, void *handle, struct fs_dirent *ent);
+	void (*dirclose)(void *handle);
+	int (*stat)(struct ffi *ffi, FILE *fp, struct fnode *fnode, struct fs_stat *st); // 簇链损坏时返回-1
+	time_t (*clamp_time)(time_t t); // 把时间限制在目录项能表示的范围内，即写回后读出的时间
+	// 返回文件数据所在的区间数，区间表由调用者释放，之后可以不经过块缓存直接从映像读取(可以在其他线程)
+	int (*get_runs)(struct ffi *ffi, FILE *fp, struct fnode *fnode, struct fs_run **runs);
+	void (*umount)(struct ffi *ffi, FILE *fp, struct _partition_s *part);
+	int (*mkfs)(struct ffi *ffi, FILE *fp, uint32_t start, uint32_t sectors, uint32_t clus_size,
+				uint32_t sector_size);
+	// 检查文件系统的一致性，repair为1时修复，返回发现的问题数
+	int (*fsck)(struct ffi *ffi, FILE *fp, struct _partition_s *part, int repair, int jobs);
+	// 把有碎片的文件移到连续的空闲簇，返回移动的文件数
+	int (*defrag)(struct ffi *ffi, FILE *fp, struct _partition_s *part);
 };
 
-void fs_init(struct _partition_s *p[4], struct ffi *ffi, FILE *fp, int origin);
+void fs_init(struct _partition_s *p[4], struct ffi *ffi, FILE *fp, struct bcache *cache, uint64_t origin);
+void fs_exit(struct _partition_s *p[4], struct ffi *ffi, FILE *fp);
+int fs_mkfs(struct ffi *ffi, FILE *fp, uint64_t sectors, uint32_t clus_size, uint32_t sector_size);
+struct fnode *dcache_lookup(partition_t *part, const char *path, int len);
+void dcache_insert(partition_t *part, const char *path, int len, struct fnode *fnode);
+void dcache_free(partition_t *part, struct ffi *ffi, FILE *fp);
@@ -1,14 +1,49 @@
 #include "imagetool.h"
+#include "cache.h"
 #include "ff.h"
 #include "fs.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <utime.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 int main(int argc, char **argv) {
 	FILE *fp;
 	struct ffi *ffi;
 	partition_t *pt[4];
+	struct bcache *cache;
+	char *backend		= NULL;
+	uint64_t cache_size = BCACHE_DEFAULT_SIZE;
+	int verbose			= 0;
+	int ret;
+
+	// 全局选项放在映像路径之前
+	while (argc > 2 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-b") == 0) {
+			backend = argv[2];
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "-c") == 0) {
+			cache_size = strtoull(argv[2], NULL, 10) * 1024 * 1024;
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "-v") == 0) {
+			verbose = 1;
+			argc--;
+			argv++;
+		} else {
+			printf("Unknown option \"%s\"!\n", argv[1]);
+			exit(-1);
+		}
+	}
 
 	if (argc < 2) {
 		exit(-1);
@@ -19,6 +54,7 @@ Imagetool version %s \n \
 Copyright (C) 2023 Ryan Wang\n", VERSION);
 		}
 	}
+	if (argc >= 4 && strcmp(argv[2], "mkfs") == 0) exit(do_mkfs(argv[1], argc - 3, argv + 3, backend));
 	fp = fopen(argv[1], "rb+");
 	if (fp == NULL) {
 		perror("imgtool");
@@ -27,16 +63,96 @@ Copyright (C) 2023 Ryan Wang\n", VERSION);
 #ifdef DEBUG
 	setbuf(fp, NULL); // 禁用缓冲区，调试用
 #endif
-	ffi = ff_init(fp, argv[1]);
+	ffi = ff_init(fp, argv[1], backend);
 	if (ffi == NULL) {
 		printf("Unknown file format!\n");
 		fclose(fp);
 		exit(-1);
 	}
-	fs_init(pt, ffi, fp, 0);
-	do_commands(argc - 2, argv + 2, pt, ffi, fp);
+	cache = bcache_create(ffi, fp, cache_size);
+	fs_init(pt, ffi, fp, cache, 0);
+	ret = do_commands(argc - 2, argv + 2, pt, ffi, fp);
+	fs_exit(pt, ffi, fp);
+	bcache_flush(cache);
+	if (verbose) {
+		printf("Cache: %llu hits, %llu misses, %llu writebacks\n", (unsigned long long)cache->hits,
+			   (unsigned long long)cache->misses, (unsigned long long)cache->writebacks);
+	}
+	bcache_destroy(cache);
+	ffi->exit(fp);
+	fclose(fp);
+	exit(ret);
+}
+
+// 解析带K/M/G后缀的大小
+static uint64_t parse_size(char *s) {
+	char *end;
+	uint64_t size = strtoull(s, &end, 10);
+	switch (*end) {
+	case 'G':
+	case 'g':
+		size *= 1024;
+		// fall through
+	case 'M':
+	case 'm':
+		size *= 1024;
+		// fall through
+	case 'K':
+	case 'k':
+		size *= 1024;
+	}
+	return size;
+}
+
+/**
+ * 创建大小为size的新映像并格式化为FAT32，已存在的映像会被覆盖
+ * 映像文件只设置长度不写入数据，未写入的部分在支持稀疏文件的系统上不占用空间
+ */
+int do_mkfs(char *path, int argc, char **argv, char *backend) {
+	FILE *fp;
+	struct ffi *ffi;
+	uint64_t size		 = parse_size(argv[0]);
+	uint32_t clus_size	 = argc >= 2 ? parse_size(argv[1]) : 0;
+	uint32_t sector_size = argc >= 3 ? parse_size(argv[2]) : SECTOR_SIZE;
+	int ret;
+
+	if (size < (uint64_t)MKFS_PART_OFFSET * 2) {
+		printf("Image size \"%s\" is too small!\n", argv[0]);
+		return -1;
+	}
+	if (sector_size != 512 && sector_size != 1024 && sector_size != 2048 && sector_size != 4096) {
+		printf("Unsupported sector size \"%s\"!\n", argv[2]);
+		return -1;
+	}
+	fp = fopen(path, "wb+");
+	if (fp == NULL) {
+		perror("imgtool");
+		return -1;
+	}
+#ifdef _WIN32
+	ret = _chsize_s(_fileno(fp), size);
+#else
+	ret = ftruncate(fileno(fp), size);
+#endif
+	if (ret != 0) {
+		perror("imgtool");
+		fclose(fp);
+		return -1;
+	}
+	ffi = ff_init(fp, path, backend);
+	if (ffi == NULL) {
+		printf("Unknown file format!\n");
+		fclose(fp);
+		return -1;
+	}
+	ret = fs_mkfs(ffi, fp, size / sector_size, clus_size, sector_size);
+	ffi->exit(fp);
 	fclose(fp);
-	exit(0);
+	if (ret != 0) {
+		printf("Can't create FAT32 on %s with this size and cluster size!\n", path);
+		remove(path);
+	}
+	return ret;
 }
 
 partition_t *get_part(char *path, partition_t *pt[4], int *p) {
@@ -62,44 +178,202 @@ partition_t *get_part(char *path, partition_t *pt[4], int *p) {
 	return NULL;
 }
 
-void do_commands(int argc, char **argv, partition_t *pt[4], struct ffi *ffi, FILE *fp) {
+// 执行一条命令，参数错误时返回-1
+int do_commands(int argc, char **argv, partition_t *pt[4], struct ffi *ffi, FILE *fp) {
+	if (argc < 1) {
+		printf("Too few arguments!\n");
+		return -1;
+	}
 	if (strcmp(argv[0], "copy") == 0) {
 		if (argc < 3) {
 			printf("Too few arguments!\n");
-			exit(-1);
+			return -1;
+		}
+		return copy_file(pt, ffi, fp, argv[1], argv[2], 0);
+	} else if (strcmp(argv[0], "copydir") == 0 || strcmp(argv[0], "sync") == 0) {
+		int jobs = 1, flags = argv[0][0] == 's' ? COPY_SYNC : 0;
+		while (argc >= 2 && argv[1][0] == '-') {
+			if (strcmp(argv[1], "-s") == 0) {
+				flags |= COPY_SYNC;
+				argc--;
+				argv++;
+			} else if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+				jobs = atoi(argv[2]);
+				argc -= 2;
+				argv += 2;
+			} else {
+				printf("Unknown option \"%s\"!\n", argv[1]);
+				return -1;
+			}
 		}
-		copy_file(pt, ffi, fp, argv[1], argv[2]);
-	} else if (strcmp(argv[0], "copydir") == 0) {
 		if (argc < 3) {
 			printf("Too few arguments!\n");
-			exit(-1);
+			return -1;
+		}
+		if (jobs > 1) return copy_dir_parallel(pt, ffi, fp, argv[1], argv[2], jobs, flags);
+		return copy_dir(pt, ffi, fp, argv[1], argv[2], flags);
+	} else if (strcmp(argv[0], "verify") == 0) {
+		int jobs = VERIFY_JOBS;
+		if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+			jobs = atoi(argv[2]);
+			argc -= 2;
+			argv += 2;
 		}
-		copy_dir(pt, ffi, fp, argv[1], argv[2]);
+		if (argc < 3) {
+			printf("Too few arguments!\n");
+			return -1;
+		}
+		return verify_dir_parallel(pt, ffi, fp, argv[1], argv[2], jobs > 0 ? jobs : 1);
+	} else if (strcmp(argv[0], "check") == 0) {
+		int jobs = VERIFY_JOBS, repair = 0;
+		while (argc >= 2 && argv[1][0] == '-') {
+			if (strcmp(argv[1], "-r") == 0) {
+				repair = 1;
+				argc--;
+				argv++;
+			} else if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+				jobs = atoi(argv[2]);
+				argc -= 2;
+				argv += 2;
+			} else {
+				printf("Unknown option \"%s\"!\n", argv[1]);
+				return -1;
+			}
+		}
+		if (argc < 2) {
+			printf("Too few arguments!\n");
+			return -1;
+		}
+		return do_check(pt, ffi, fp, argv[1], repair, jobs > 0 ? jobs : 1);
+	} else if (strcmp(argv[0], "defrag") == 0) {
+		if (argc < 2) {
+			printf("Too few arguments!\n");
+			return -1;
+		}
+		return do_defrag(pt, ffi, fp, argv[1]);
 	} else if (strcmp(argv[0], "mkdir") == 0) {
 		if (argc < 3) {
 			printf("Too few arguments!\n");
-			exit(-1);
+			return -1;
 		}
-		do_mkdir(pt, ffi, fp, argv[1], argv[2]);
+		return do_mkdir(pt, ffi, fp, argv[1], argv[2]);
+	} else if (strcmp(argv[0], "extract") == 0 || strcmp(argv[0], "copyout") == 0) {
+		if (argc < 3) {
+			printf("Too few arguments!\n");
+			return -1;
+		}
+		return do_extract(pt, ffi, fp, argv[1], argv[2]);
+	} else if (strcmp(argv[0], "ls") == 0 || strcmp(argv[0], "tree") == 0 || strcmp(argv[0], "stat") == 0) {
+		if (argc < 2) {
+			printf("Too few arguments!\n");
+			return -1;
+		}
+		if (argv[0][0] == 'l') return do_ls(pt, ffi, fp, argv[1]);
+		else if (argv[0][0] == 't') return do_tree(pt, ffi, fp, argv[1]);
+		return do_stat(pt, ffi, fp, argv[1]);
+	} else if (strcmp(argv[0], "batch") == 0) {
+		if (argc < 2) {
+			printf("Too few arguments!\n");
+			return -1;
+		}
+		return do_batch(pt, ffi, fp, argv[1]);
 	} else {
 		printf("Command Error!\n");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * 从文件(path为"-"时从标准输入)逐行读取命令并执行，所有命令共用一次挂载
+ * 参数以空白分隔，含空格的参数用双引号括起来，空行和'#'开头的行被忽略
+ * 超过BATCH_LINE_MAX或参数多于BATCH_ARGS_MAX的行不执行，按出错处理
+ * 出错的命令不影响后面的命令，有命令出错时返回-1
+ */
+int do_batch(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path) {
+	FILE *in;
+	char line[BATCH_LINE_MAX], *argv[BATCH_ARGS_MAX], *p;
+	int argc, c, len, lineno = 0, ret = 0;
+
+	in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (in == NULL) {
+		perror("imgtool");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), in) != NULL) {
+		lineno++;
+		len = strlen(line);
+		// fgets把过长的行拆成几段，丢弃这一行剩下的部分，不把后面的部分当作命令执行
+		if (len > 0 && line[len - 1] != '\n' && (c = fgetc(in)) != EOF && c != '\n') {
+			while ((c = fgetc(in)) != EOF && c != '\n')
+				;
+			p = line + strspn(line, " \t");
+			if (*p == '#') continue;
+			printf("Line %d: line is longer than %d characters!\n", lineno, BATCH_LINE_MAX - 1);
+			ret = -1;
+			continue;
+		}
+		argc = 0;
+		p	 = line;
+		for (;;) {
+			while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+				p++;
+			if (*p == 0 || argc == BATCH_ARGS_MAX) break;
+			if (*p == '"') {
+				argv[argc++] = ++p;
+				while (*p != 0 && *p != '"')
+					p++;
+			} else {
+				argv[argc++] = p;
+				while (*p != 0 && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+					p++;
+			}
+			if (*p != 0) *p++ = 0;
+		}
+		if (argc == 0 || argv[0][0] == '#') continue;
+		if (*p != 0) {
+			printf("Line %d: more than %d arguments!\n", lineno, BATCH_ARGS_MAX);
+			ret = -1;
+			continue;
+		}
+		if (strcmp(argv[0], "batch") == 0 || do_commands(argc, argv, pt, ffi, fp) != 0) {
+			printf("Line %d: command \"%s\" failed!\n", lineno, argv[0]);
+			ret = -1;
+		}
 	}
+	if (in != stdin) fclose(in);
+	return ret;
 }
 
-void copy_file(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst) {
-	int i, tmp;
-	FILE *from;
+int copy_file(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst, int flags) {
+	struct stat st;
+
+	if (stat(src, &st) != 0) {
+		perror("File open error");
+		return -1;
+	}
+	return write_file(pt, ffi, fp, src, dst, NULL, NULL, 0, st.st_size, st.st_mtime, flags);
+}
+
+/**
+ * 把主机文件写入映像中的dst目录，文件名取src的最后一部分，修改时间设为mtime
+ * from为已打开的文件时，head为已经读入内存的文件开头len字节，from从len处继续读，
+ * from为空时需要写入才打开src，flags含COPY_SYNC时映像中大小和修改时间都相同的文件不再写入
+ * 写入或跳过时返回0，出错时返回-1
+ */
+int write_file(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst, FILE *from, uint8_t *head,
+			   uint32_t len, uint64_t size, time_t mtime, int flags) {
+	int i, tmp, created = 0;
 	char *to, *p;
-	char buf[512];
+	char *buf;
+	FILE *opened = NULL;
 	partition_t *part;
 	struct fnode *parent, *fnode;
 
-	from = fopen(src, "rb");
-	if (from == NULL) {
-		perror("File open error");
-		return;
+	if (size > COPY_MAX_SIZE) {
+		printf("\"%s\" is larger than the 4 GiB FAT32 file size limit!\n", src);
+		return -1;
 	}
-
 	p  = src;
 	to = dst;
 
@@ -113,44 +387,336 @@ void copy_file(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *d
 
 	if (part == NULL) {
 		printf("Unknown path  \"%s\"!\n", dst);
-		fclose(from);
-		return;
+		return -1;
 	}
 	to += i;
 	parent = part->fsi->opendir(ffi, fp, part, to);
 	if (parent == NULL) {
 		printf("Can't find directory \"%s\"\n", dst);
-		fclose(from);
-		return;
+		return -1;
 	}
+	// 映像中保存的是限制在文件系统范围内的时间，同步时也按这个时间比较
+	if (part->fsi->clamp_time != NULL) mtime = part->fsi->clamp_time(mtime);
 	fnode = part->fsi->open(ffi, fp, part, parent, p);
 	if (fnode == NULL) {
 		fnode = part->fsi->createfile(ffi, fp, part, parent, p, strlen(p));
 		if (fnode == NULL) {
 			printf("Create file \"%s\" failed!\n", p);
-			fclose(from);
-			return;
+			return -1;
 		}
+		created = 1;
 		printf("Create file \"%s\".\n", src);
+	} else if ((flags & COPY_SYNC) && fnode->size == size && fnode->mtime / 2 == mtime / 2) {
+		// 目录项中的时间精确到2秒
+		part->fsi->close(ffi, fp, fnode);
+		return 0;
+	}
+	if (from == NULL && (from = opened = fopen(src, "rb")) == NULL) {
+		perror("File open error");
+		part->fsi->close(ffi, fp, fnode);
+		return -1;
+	}
+	if (part->fsi->truncate != NULL && fnode->size > size) part->fsi->truncate(ffi, fp, fnode, size);
+
+	if (part->fsi->prealloc != NULL && part->fsi->prealloc(ffi, fp, fnode, size) != 0) {
+		printf("Not enough space for \"%s\"!\n", src);
+		// prealloc失败时已经释放了新分配的簇，刚创建的文件也删除，不留下空文件
+		if (created && part->fsi->delete != NULL) part->fsi->delete(ffi, fp, part, fnode);
+		part->fsi->close(ffi, fp, fnode);
+		if (opened != NULL) fclose(opened);
+		return -1;
 	}
 
-	int pos = 0;
 	printf("Copying %s\n", src);
-	do {
-		fseek(from, pos, SEEK_SET);
-		tmp = fread(buf, 1, SECTOR_SIZE, from);
-		part->fsi->seek(ffi, fp, fnode, pos, SEEK_SET);
-		part->fsi->write(ffi, fp, fnode, (uint8_t *)buf, tmp);
-		pos += tmp;
-	} while (tmp == SECTOR_SIZE);
-	fclose(from);
+	part->fsi->seek(ffi, fp, fnode, 0, SEEK_SET);
+	if (len > 0) part->fsi->write(ffi, fp, fnode, head, len);
+	if (len < size) {
+		buf = malloc(COPY_BUFFER_SIZE);
+		if (buf == NULL) {
+			perror("imgtool");
+			part->fsi->close(ffi, fp, fnode);
+			if (opened != NULL) fclose(opened);
+			return -1;
+		}
+		while ((tmp = fread(buf, 1, COPY_BUFFER_SIZE, from)) > 0) {
+			part->fsi->write(ffi, fp, fnode, (uint8_t *)buf, tmp);
+		}
+		free(buf);
+	}
+	// 主机文件在复制过程中变短或读取出错时，释放按原大小预分配的多余的簇
+	if (part->fsi->truncate != NULL && fnode->offset < size) part->fsi->truncate(ffi, fp, fnode, fnode->offset);
+	// 使用主机文件的修改时间，之后同步时才能判断文件是否改变
+	fnode->mtime = mtime;
+	fnode->dirty = 1;
+	part->fsi->close(ffi, fp, fnode);
+	if (opened != NULL) fclose(opened);
+	return 0;
+}
+
+// 检查path所在的分区，没有问题或问题都已修复时返回0
+int do_check(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path, int repair, int jobs) {
+	partition_t *part;
+	int i, n;
+
+	part = get_part(path, pt, &i);
+	if (part == NULL) {
+		printf("Unknown path  \"%s\"!\n", path);
+		return -1;
+	}
+	if (part->fsi->fsck == NULL) {
+		printf("Checking is not supported on \"%s\"!\n", path);
+		return -1;
+	}
+	n = part->fsi->fsck(ffi, fp, part, repair, jobs);
+	return n == 0 || (n > 0 && repair) ? 0 : -1;
+}
+
+// 整理path所在分区的文件碎片
+int do_defrag(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path) {
+	partition_t *part;
+	int i;
+
+	part = get_part(path, pt, &i);
+	if (part == NULL) {
+		printf("Unknown path  \"%s\"!\n", path);
+		return -1;
+	}
+	if (part->fsi->defrag == NULL) {
+		printf("Defragmenting is not supported on \"%s\"!\n", path);
+		return -1;
+	}
+	return part->fsi->defrag(ffi, fp, part) < 0 ? -1 : 0;
+}
+
+/**
+ * 打开映像中的文件或目录path，*p返回分区内路径在path中的位置
+ * *is_dir为0时打开的是文件，用完后需要close，目录由目录缓存管理，不需要关闭
+ */
+struct fnode *open_path(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path, partition_t **part, int *p,
+						int *is_dir) {
+	struct fnode *parent, *fnode = NULL;
+	char *dir, *name;
+
+	*part = get_part(path, pt, p);
+	if (*part == NULL) {
+		printf("Unknown path  \"%s\"!\n", path);
+		return NULL;
+	}
+	dir	 = strdup(path + *p);
+	name = strrchr(dir, '/');
+	if (name != NULL) *name++ = 0;
+	else name = dir;
+	if (*name != 0 && (parent = (*part)->fsi->opendir(ffi, fp, *part, name == dir ? "" : dir)) != NULL)
+		fnode = (*part)->fsi->open(ffi, fp, *part, parent, name);
+	free(dir);
+	*is_dir = fnode == NULL;
+	if (fnode == NULL) fnode = (*part)->fsi->opendir(ffi, fp, *part, path + *p);
+	if (fnode == NULL) printf("Can't find \"%s\"\n", path);
+	return fnode;
+}
+
+/**
+ * 把映像中的文件或目录src复制到主机上的目录dst
+ * src是分区根目录或以'/'结尾时复制目录中的内容，否则在dst中创建同名的文件或目录
+ */
+int do_extract(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst) {
+	partition_t *part;
+	struct fnode *fnode;
+	char *name, *to;
+	uint8_t *buf;
+	int i, is_dir, ret;
+
+	fnode = open_path(pt, ffi, fp, src, &part, &i, &is_dir);
+	if (fnode == NULL) return -1;
+	buf = malloc(COPY_BUFFER_SIZE);
+	if (buf == NULL) {
+		perror("imgtool");
+		if (!is_dir) part->fsi->close(ffi, fp, fnode);
+		return -1;
+	}
+	name = strrchr(src + i, '/');
+	name = name != NULL ? name + 1 : src + i;
+	to	 = malloc(strlen(dst) + strlen(name) + 2);
+	sprintf(to, "%s/%s", dst, name);
+	if (!is_dir) {
+		ret = extract_file(part, ffi, fp, fnode, to, buf);
+		part->fsi->close(ffi, fp, fnode);
+	} else {
+		ret = host_mkdir(to) != 0 ? -1 : extract_dir(part, ffi, fp, fnode, src + i, to, buf);
+	}
+	free(to);
+	free(buf);
+	return ret;
+}
+
+// 按ls的格式输出一个文件
+static void print_entry(struct fs_dirent *ent) {
+	char date[20];
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&ent->mtime));
+	printf("%c %10llu %s %s%s\n", ent->is_dir ? 'd' : '-', (unsigned long long)ent->size, date, ent->name,
+		   ent->is_dir ? "/" : "");
 }
 
-void do_mkdir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst) {
+// 列出目录中的文件，path是文件时只列出这个文件
+int do_ls(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path) {
+	struct fs_dirent *ent = malloc(sizeof(struct fs_dirent));
+	partition_t *part;
+	struct fnode *fnode;
+	uint32_t count = 0;
+	void *handle;
+	int i, is_dir;
+
+	fnode = open_path(pt, ffi, fp, path, &part, &i, &is_dir);
+	if (fnode == NULL) {
+		free(ent);
+		return -1;
+	}
+	if (!is_dir) {
+		snprintf(ent->name, FS_NAME_MAX, "%s", fnode->name);
+		ent->is_dir = 0;
+		ent->size	= fnode->size;
+		ent->mtime	= fnode->mtime;
+		print_entry(ent);
+		part->fsi->close(ffi, fp, fnode);
+		free(ent);
+		return 0;
+	}
+	handle = part->fsi->diropen(ffi, fp, fnode);
+	while (part->fsi->readdir(ffi, fp, handle, ent)) {
+		print_entry(ent);
+		count++;
+	}
+	part->fsi->dirclose(handle);
+	printf("%u entries\n", count);
+	free(ent);
+	return 0;
+}
+
+/**
+ * 递归输出目录树，prefix是当前层之前的缩进
+ * 为了知道哪一项是目录中的最后一项，readdir总是比输出多读一项
+ */
+static void print_tree(partition_t *part, struct ffi *ffi, FILE *fp, struct fnode *dir, char *path, char *prefix,
+					   uint32_t *dirs, uint32_t *files) {
+	struct fs_dirent *ent = malloc(2 * sizeof(struct fs_dirent)), *cur, *next;
+	struct fnode *fnode;
+	char *sub, *subprefix;
+	void *handle;
+	int more;
+
+	handle = part->fsi->diropen(ffi, fp, dir);
+	cur	   = ent;
+	next   = ent + 1;
+	more   = part->fsi->readdir(ffi, fp, handle, cur);
+	while (more) {
+		more = part->fsi->readdir(ffi, fp, handle, next);
+		printf("%s%s%s\n", prefix, more ? "|-- " : "`-- ", cur->name);
+		if (cur->is_dir) {
+			(*dirs)++;
+			sub		  = malloc(strlen(path) + strlen(cur->name) + 2);
+			subprefix = malloc(strlen(prefix) + 5);
+			sprintf(sub, "%s/%s", path, cur->name);
+			sprintf(subprefix, "%s%s", prefix, more ? "|   " : "    ");
+			fnode = part->fsi->opendir(ffi, fp, part, sub);
+			if (fnode != NULL) print_tree(part, ffi, fp, fnode, sub, subprefix, dirs, files);
+			free(sub);
+			free(subprefix);
+		} else {
+			(*files)++;
+		}
+		cur	 = cur == ent ? ent + 1 : ent;
+		next = next == ent ? ent + 1 : ent;
+	}
+	part->fsi->dirclose(handle);
+	free(ent);
+}
+
+int do_tree(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path) {
+	partition_t *part;
+	struct fnode *fnode;
+	uint32_t dirs = 0, files = 0;
+	int i, is_dir;
+
+	fnode = open_path(pt, ffi, fp, path, &part, &i, &is_dir);
+	if (fnode == NULL) return -1;
+	printf("%s\n", path);
+	if (!is_dir) {
+		part->fsi->close(ffi, fp, fnode);
+		return 0;
+	}
+	print_tree(part, ffi, fp, fnode, path + i, "", &dirs, &files);
+	printf("\n%u directories, %u files\n", dirs, files);
+	return 0;
+}
+
+// 输出文件或目录的详细信息
+int do_stat(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path) {
+	partition_t *part;
+	struct fnode *fnode;
+	struct fs_stat st;
+	char date[32];
+	int i, is_dir, ret;
+
+	fnode = open_path(pt, ffi, fp, path, &part, &i, &is_dir);
+	if (fnode == NULL) return -1;
+	ret = part->fsi->stat(ffi, fp, fnode, &st);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&st.mtime));
+	printf("  File: %s\n", path);
+	printf("  Type: %s\n", is_dir ? "directory" : "file");
+	printf("  Size: %llu\n", (unsigned long long)st.size);
+	printf("  Attr: 0x%02x\n", st.attr);
+	printf("Modify: %s\n", date);
+	printf("Blocks: %u x %u bytes in %u extents, first block %u\n", st.blocks, st.block_size, st.extents,
+		   st.first_block);
+	if (ret != 0) printf("The cluster chain of \"%s\" is broken, run check to repair it\n", path);
+	if (!is_dir) part->fsi->close(ffi, fp, fnode);
+	return ret;
+}
+
+/**
+ * 把映像中已打开的文件复制为主机上的文件dst，并设置相同的修改时间
+ * 每次最多读取COPY_BUFFER_SIZE字节，其中每个连续的簇区间只读一次
+ */
+int extract_file(partition_t *part, struct ffi *ffi, FILE *fp, struct fnode *fnode, char *dst, uint8_t *buf) {
+	struct utimbuf times;
+	uint64_t done = 0;
+	uint32_t n;
+	FILE *to;
+
+	to = fopen(dst, "wb");
+	if (to == NULL) {
+		perror("File open error");
+		return -1;
+	}
+	printf("Extracting %s\n", dst);
+	part->fsi->seek(ffi, fp, fnode, 0, SEEK_SET);
+	while (done < fnode->size) {
+		n = MIN(fnode->size - done, COPY_BUFFER_SIZE);
+		part->fsi->read(ffi, fp, fnode, buf, n);
+		if (fnode->offset != done + n) {
+			printf("File \"%s\" is shorter than its size in the image!\n", dst);
+			fclose(to);
+			return -1;
+		}
+		if (fwrite(buf, 1, n, to) != n) {
+			perror("imgtool");
+			fclose(to);
+			return -1;
+		}
+		done += n;
+	}
+	fclose(to);
+	times.actime = times.modtime = fnode->mtime;
+	utime(dst, &times);
+	return 0;
+}
+
+int do_mkdir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst) {
 	int i, len1, len2;
 	char *s;
 	partition_t *part;
-	struct fnode *parent;
+	struct fnode *parent, *fnode;
 
 	len1 = strlen(src);
 	len2 = strlen(dst);
@@ -159,6 +725,11 @@ void do_mkdir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *ds
 	strncpy(s + len2, src, len1);
 	s[len1 + len2] = 0;
 	part		   = get_part(dst, pt, &i);
+	if (part == NULL) {
+		printf("Unknown path  \"%s\"!\n", dst);
+		free(s);
+		return -1;
+	}
 	dst += i;
 	parent = part->fsi->opendir(ffi, fp, part, s + i);
 	free(s);
@@ -166,9 +737,15 @@ void do_mkdir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *ds
 		parent = part->fsi->opendir(ffi, fp, part, dst);
 		if (parent == NULL) {
 			printf("Can't find directory \"%s\"\n", dst);
-			return;
+			return -1;
+		}
+		fnode = part->fsi->mkdir(ffi, fp, part, parent, src, len1);
+		if (fnode == NULL) {
+			printf("Can't create directory \"%s\"\n", src);
+			return -1;
 		}
-		part->fsi->mkdir(ffi, fp, part, parent, src, len1);
+		part->fsi->close(ffi, fp, fnode);
 		printf("Create directory \"%s\"\n", src);
 	}
+	return 0;
 }
\ No newline at end of file
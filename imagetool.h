@@ -4,9 +4,41 @@
 #include "fs.h"
 #include <stdio.h>
 
-void do_commands(int argc, char **argv, partition_t *pt[4], struct ffi *ffi, FILE *fp);
-void copy_file(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst);
-void do_mkdir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst);
+#define COPY_BUFFER_SIZE (8 * 1024 * 1024) // 复制文件时每次读写的大小
+#define COPY_HEAD_SIZE	 (1024 * 1024)	   // 并行复制时预先读入的文件开头大小
+#define COPY_WINDOW		 64				   // 并行复制时最多提前读取的文件数
+#define COPY_MAX_SIZE	 0xffffffffULL	   // FAT32目录项中的文件大小只有32位，不能复制4GiB及更大的文件
+
+#define VERIFY_CHUNK_SIZE (4 * 1024 * 1024) // 校验时每次比较的大小
+#define VERIFY_WINDOW	  256				// 校验时最多排队等待比较的文件数
+#define VERIFY_JOBS		  4					// 校验和检查分区时默认的线程数
+
+#define COPY_SYNC 0x01 // 跳过映像中大小和修改时间都相同的文件
+
+#define BATCH_LINE_MAX 4096 // 批处理文件中一行的最大长度
+#define BATCH_ARGS_MAX 16
+
+int do_commands(int argc, char **argv, partition_t *pt[4], struct ffi *ffi, FILE *fp);
+int do_mkfs(char *path, int argc, char **argv, char *backend);
+int do_batch(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path);
+int copy_file(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst, int flags);
+int write_file(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst, FILE *from, uint8_t *head,
+			   uint32_t len, uint64_t size, time_t mtime, int flags);
+struct fnode *open_path(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path, partition_t **part, int *p,
+						int *is_dir);
+int do_check(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path, int repair, int jobs);
+int do_defrag(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path);
+int do_ls(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path);
+int do_tree(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path);
+int do_stat(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *path);
+int do_extract(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst);
+int extract_file(partition_t *part, struct ffi *ffi, FILE *fp, struct fnode *fnode, char *dst, uint8_t *buf);
+int do_mkdir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst);
 partition_t *get_part(char *path, partition_t *pt[4], int *p);
 
-void copy_dir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst);
\ No newline at end of file
+int copy_dir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst, int flags);
+int copy_dir_parallel(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst, int jobs, int flags);
+int verify_dir_parallel(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst, int jobs);
+int host_mkdir(char *path);
+int extract_dir(partition_t *part, struct ffi *ffi, FILE *fp, struct fnode *dir, char *path, char *dst,
+				uint8_t *buf);
\ No newline at end of file
@@ -5,9 +5,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
-void copy_dir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst) {
-	int flag;
+// 复制主机目录src中的所有文件和子目录到映像中的dst，出错的文件不影响其他文件，有文件出错时返回-1
+int copy_dir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst, int flags) {
+	int flag, ret = 0;
 #ifdef __linux__
 	DIR *dir;
 	struct dirent *ptr;
@@ -15,7 +17,7 @@ void copy_dir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *ds
 	dir = opendir(src);
 	if (dir == NULL) {
 		printf("Open dir %s failed!\n", src);
-		return;
+		return -1;
 	}
 
 	ptr = readdir(dir);
@@ -40,11 +42,11 @@ void copy_dir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *ds
 	free(new);
 	if (handle == INVALID_HANDLE_VALUE) {
 		printf("Open dir %s failed!\n", src);
-		return;
+		return -1;
 	}
 #else
 	printf("Unsupport this Operating System!\n");
-	return;
+	return -1;
 #endif
 	do {
 		char *filename = FILE_NAME(ptr);
@@ -53,10 +55,10 @@ void copy_dir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *ds
 		int len	 = strlen(filename);
 		int len1 = strlen(src), len2 = strlen(dst);
 
-		char *tmp1 = malloc(len1 + len + 1);
-		char *tmp2 = malloc(len2 + len + 1);
-		memset(tmp1, 0, len + len1 + 1);
-		memset(tmp2, 0, len + len2 + 1);
+		char *tmp1 = malloc(len1 + len + 2); // 末尾可能还要加'/'
+		char *tmp2 = malloc(len2 + len + 2);
+		memset(tmp1, 0, len + len1 + 2);
+		memset(tmp2, 0, len + len2 + 2);
 
 		strncpy(tmp1, src, len1);
 		strncpy(tmp2, dst, len2);
@@ -69,12 +71,11 @@ void copy_dir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *ds
 			strncat(tmp2, "/", 2);
 			partition_t *part	= get_part(dst, pt, &i);
 			struct fnode *fnode = part->fsi->opendir(ffi, fp, part, tmp2 + i);
-			if (fnode == NULL) { do_mkdir(pt, ffi, fp, filename, dst); }
-
-			copy_dir(pt, ffi, fp, tmp1, tmp2);
+			if (fnode == NULL && do_mkdir(pt, ffi, fp, filename, dst) != 0) ret = -1;
+			else if (copy_dir(pt, ffi, fp, tmp1, tmp2, flags) != 0) ret = -1;
 
 		} else if (FILE_ATTR(ptr) & FILE_ATTR_FILE) {
-			copy_file(pt, ffi, fp, tmp1, dst);
+			if (copy_file(pt, ffi, fp, tmp1, dst, flags) != 0) ret = -1;
 		}
 		free(tmp1);
 		free(tmp2);
@@ -86,4 +87,515 @@ void copy_dir(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *ds
 		flag = FindNextFile(handle, &ptr) != 0;
 #endif
 	} while (flag);
-}
\ No newline at end of file
+#ifdef __linux__
+	closedir(dir);
+#elif _WIN32
+	FindClose(handle);
+#endif
+	return ret;
+}
+
+// 在主机上创建目录，目录已存在时也返回0
+int host_mkdir(char *path) {
+	struct stat st;
+
+	if (HOST_MKDIR(path) == 0 || (stat(path, &st) == 0 && (st.st_mode & S_IFDIR))) return 0;
+	printf("Create directory %s failed!\n", path);
+	return -1;
+}
+
+/**
+ * 把映像中的目录dir(分区内路径为path)下的所有文件和子目录复制到主机上的目录dst
+ * 按目录中的顺序遍历，子目录通过路径打开，有文件复制失败时返回-1
+ */
+int extract_dir(partition_t *part, struct ffi *ffi, FILE *fp, struct fnode *dir, char *path, char *dst,
+				uint8_t *buf) {
+	struct fs_dirent *ent = malloc(sizeof(struct fs_dirent));
+	struct fnode *fnode;
+	char *from, *to;
+	void *handle;
+	int ret = 0;
+
+	handle = part->fsi->diropen(ffi, fp, dir);
+	while (part->fsi->readdir(ffi, fp, handle, ent)) {
+		from = malloc(strlen(path) + strlen(ent->name) + 2);
+		to	 = malloc(strlen(dst) + strlen(ent->name) + 2);
+		sprintf(from, "%s/%s", path, ent->name);
+		sprintf(to, "%s/%s", dst, ent->name);
+		if (ent->is_dir) {
+			fnode = part->fsi->opendir(ffi, fp, part, from);
+			if (fnode == NULL || host_mkdir(to) != 0 || extract_dir(part, ffi, fp, fnode, from, to, buf) != 0)
+				ret = -1;
+		} else {
+			fnode = part->fsi->open(ffi, fp, part, dir, ent->name);
+			if (fnode == NULL || extract_file(part, ffi, fp, fnode, to, buf) != 0) ret = -1;
+			if (fnode != NULL) part->fsi->close(ffi, fp, fnode);
+		}
+		free(from);
+		free(to);
+	}
+	part->fsi->dirclose(handle);
+	free(ent);
+	return ret;
+}
+
+#ifdef __linux__
+
+#include <pthread.h>
+
+// 并行复制中的一项作业，按枚举顺序排成链表，由写入线程按顺序处理
+struct copy_job {
+	char *src, *dst; // 主机上的路径和映像中的目标目录
+	char *name;		 // 目录作业要创建的目录名
+	int is_dir;
+	int ready; // 文件已由工作线程打开并读入开头
+	FILE *from;
+	uint8_t *head;
+	uint32_t len;
+	uint64_t size;
+	time_t mtime;
+	uint32_t seq;
+	struct copy_job *next;
+};
+
+struct copy_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct copy_job *head, *tail;
+	struct copy_job *claim; // 下一个等待工作线程读取的文件作业
+	uint32_t count;			// 已枚举的作业数
+	uint32_t consumed;		// 已写入映像的作业数
+	int done;				// 枚举已结束
+	int failed;				// 有目录无法枚举
+	int flags;
+	char *src, *dst;
+};
+
+static void copy_queue_push(struct copy_queue *q, char *src, char *dst, char *name, int is_dir) {
+	struct copy_job *job = calloc(1, sizeof(struct copy_job));
+	job->src			 = src;
+	job->dst			 = strdup(dst);
+	job->name			 = name != NULL ? strdup(name) : NULL;
+	job->is_dir			 = is_dir;
+
+	pthread_mutex_lock(&q->lock);
+	job->seq = q->count++;
+	if (q->tail != NULL) q->tail->next = job;
+	else q->head = job;
+	q->tail = job;
+	if (q->claim == NULL && !is_dir) q->claim = job;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+// 按与copy_dir相同的顺序枚举主机目录，子目录先生成创建目录的作业再递归
+static void copy_enum_dir(struct copy_queue *q, char *src, char *dst) {
+	DIR *dir;
+	struct dirent *ptr;
+	char *tmp1, *tmp2;
+	int len, len1 = strlen(src), len2 = strlen(dst);
+
+	dir = opendir(src);
+	if (dir == NULL) {
+		printf("Open dir %s failed!\n", src);
+		pthread_mutex_lock(&q->lock);
+		q->failed = 1;
+		pthread_mutex_unlock(&q->lock);
+		return;
+	}
+	while ((ptr = readdir(dir)) != NULL) {
+		char *filename = FILE_NAME(ptr);
+		if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) continue;
+
+		len	 = strlen(filename);
+		tmp1 = malloc(len1 + len + 2);
+		sprintf(tmp1, "%s%s", src, filename);
+		if (FILE_ATTR(ptr) & FILE_ATTR_DIR) {
+			tmp2 = malloc(len2 + len + 2);
+			sprintf(tmp2, "%s%s/", dst, filename);
+			strcat(tmp1, "/");
+			copy_queue_push(q, NULL, dst, filename, 1);
+			copy_enum_dir(q, tmp1, tmp2);
+			free(tmp1);
+			free(tmp2);
+		} else if (FILE_ATTR(ptr) & FILE_ATTR_FILE) {
+			copy_queue_push(q, tmp1, dst, NULL, 0);
+		} else {
+			free(tmp1);
+		}
+	}
+	closedir(dir);
+}
+
+static void *copy_enum_thread(void *arg) {
+	struct copy_queue *q = arg;
+
+	copy_enum_dir(q, q->src, q->dst);
+	pthread_mutex_lock(&q->lock);
+	q->done = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+/**
+ * 工作线程按顺序领取文件作业，打开文件并读入开头部分
+ * 只领取写入线程之后COPY_WINDOW个以内的作业，限制内存占用
+ */
+static void *copy_worker_thread(void *arg) {
+	struct copy_queue *q = arg;
+	struct copy_job *job;
+	struct stat st;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		job = q->claim;
+		if (job == NULL && q->done) break;
+		if (job == NULL || job->seq >= q->consumed + COPY_WINDOW) {
+			pthread_cond_wait(&q->cond, &q->lock);
+			continue;
+		}
+		for (q->claim = job->next; q->claim != NULL && q->claim->is_dir; q->claim = q->claim->next)
+			;
+		pthread_mutex_unlock(&q->lock);
+
+		// 同步时大多数文件不需要写入，只取得大小和修改时间，需要写入时由写入线程打开
+		if (stat(job->src, &st) == 0) {
+			job->size  = st.st_size;
+			job->mtime = st.st_mtime;
+			if (!(q->flags & COPY_SYNC)) job->from = fopen(job->src, "rb");
+		}
+		if (job->from != NULL) {
+			job->head = malloc(job->size < COPY_HEAD_SIZE ? job->size + 1 : COPY_HEAD_SIZE);
+			job->len  = fread(job->head, 1, job->size < COPY_HEAD_SIZE ? job->size : COPY_HEAD_SIZE, job->from);
+		}
+
+		pthread_mutex_lock(&q->lock);
+		job->ready = 1;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+/**
+ * 并行复制文件夹：一个线程枚举主机目录，jobs个工作线程打开并预读文件，
+ * 当前线程按枚举顺序创建目录和写入文件，所有对映像的操作都只在当前线程进行
+ * 与copy_dir一样出错的文件不影响其他文件，有出错时返回-1
+ */
+int copy_dir_parallel(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst, int jobs, int flags) {
+	struct copy_queue q;
+	struct copy_job *job;
+	pthread_t enumerator, *workers;
+	partition_t *part;
+	char *path;
+	int i, ret = 0;
+
+	memset(&q, 0, sizeof(q));
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.cond, NULL);
+	q.src	= src;
+	q.dst	= dst;
+	q.flags = flags;
+	workers = malloc(jobs * sizeof(pthread_t));
+	pthread_create(&enumerator, NULL, copy_enum_thread, &q);
+	for (i = 0; i < jobs; i++)
+		pthread_create(&workers[i], NULL, copy_worker_thread, &q);
+
+	for (;;) {
+		pthread_mutex_lock(&q.lock);
+		while ((q.head == NULL && !q.done) || (q.head != NULL && !q.head->is_dir && !q.head->ready))
+			pthread_cond_wait(&q.cond, &q.lock);
+		job = q.head;
+		if (job == NULL) {
+			pthread_mutex_unlock(&q.lock);
+			break;
+		}
+		pthread_mutex_unlock(&q.lock);
+
+		if (job->is_dir) {
+			path = malloc(strlen(job->dst) + strlen(job->name) + 1);
+			sprintf(path, "%s%s", job->dst, job->name);
+			part = get_part(job->dst, pt, &i);
+			if ((part == NULL || part->fsi->opendir(ffi, fp, part, path + i) == NULL) &&
+				do_mkdir(pt, ffi, fp, job->name, job->dst) != 0)
+				ret = -1;
+			free(path);
+		} else if (job->from == NULL && !(flags & COPY_SYNC)) {
+			printf("Open file %s failed!\n", job->src);
+			ret = -1;
+		} else {
+			if (write_file(pt, ffi, fp, job->src, job->dst, job->from, job->head, job->len, job->size, job->mtime,
+						   flags) != 0)
+				ret = -1;
+			if (job->from != NULL) fclose(job->from);
+		}
+
+		pthread_mutex_lock(&q.lock);
+		q.head = job->next;
+		if (q.head == NULL) q.tail = NULL;
+		q.consumed++;
+		pthread_cond_broadcast(&q.cond);
+		pthread_mutex_unlock(&q.lock);
+		free(job->src);
+		free(job->dst);
+		free(job->name);
+		free(job->head);
+		free(job);
+	}
+
+	pthread_join(enumerator, NULL);
+	for (i = 0; i < jobs; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	pthread_cond_destroy(&q.cond);
+	pthread_mutex_destroy(&q.lock);
+	return q.failed ? -1 : ret;
+}
+
+// 一个需要比较内容的文件，大小已经确认相同
+struct verify_job {
+	char *src, *path; // 主机上的文件和映像中的路径
+	uint64_t size;
+	struct fs_run *runs;
+	int nrun;
+	struct verify_job *next;
+};
+
+struct verify_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct verify_job *head, *tail;
+	uint32_t pending; // 队列中等待比较的作业数
+	int done;
+	struct ffi *ffi;
+	FILE *fp;
+	uint32_t files, problems;
+	uint64_t bytes;
+};
+
+static void verify_report(struct verify_queue *q, const char *fmt, const char *path) {
+	pthread_mutex_lock(&q->lock);
+	printf(fmt, path);
+	q->problems++;
+	pthread_mutex_unlock(&q->lock);
+}
+
+// 按映像中的区间依次读出文件数据，和主机文件的对应部分逐块比较
+static void verify_compare(struct verify_queue *q, struct verify_job *job, uint8_t *a, uint8_t *b) {
+	uint64_t total = 0;
+	uint32_t off, n;
+	FILE *from;
+	int i;
+
+	from = fopen(job->src, "rb");
+	if (from == NULL) {
+		verify_report(q, "Can't open %s\n", job->src);
+		return;
+	}
+	for (i = 0; i < job->nrun; i++) {
+		for (off = 0; off < job->runs[i].length; off += n) {
+			n = job->runs[i].length - off < VERIFY_CHUNK_SIZE ? job->runs[i].length - off : VERIFY_CHUNK_SIZE;
+			q->ffi->pread(q->fp, a, n, job->runs[i].offset + off);
+			if (fread(b, 1, n, from) != n || memcmp(a, b, n) != 0) {
+				verify_report(q, "Content differs: %s\n", job->path);
+				fclose(from);
+				return;
+			}
+		}
+		total += job->runs[i].length;
+	}
+	fclose(from);
+	if (total != job->size) verify_report(q, "Cluster chain shorter than file size: %s\n", job->path);
+	pthread_mutex_lock(&q->lock);
+	q->files++;
+	q->bytes += total;
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void *verify_worker_thread(void *arg) {
+	struct verify_queue *q = arg;
+	struct verify_job *job;
+	uint8_t *a = malloc(VERIFY_CHUNK_SIZE), *b = malloc(VERIFY_CHUNK_SIZE);
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (q->head == NULL && !q->done)
+			pthread_cond_wait(&q->cond, &q->lock);
+		job = q->head;
+		if (job == NULL) break;
+		q->head = job->next;
+		if (q->head == NULL) q->tail = NULL;
+		pthread_mutex_unlock(&q->lock);
+
+		verify_compare(q, job, a, b);
+		free(job->src);
+		free(job->path);
+		free(job->runs);
+		free(job);
+
+		pthread_mutex_lock(&q->lock);
+		q->pending--;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+	free(a);
+	free(b);
+	return NULL;
+}
+
+static void verify_push(struct verify_queue *q, struct verify_job *job) {
+	pthread_mutex_lock(&q->lock);
+	while (q->pending >= VERIFY_WINDOW)
+		pthread_cond_wait(&q->cond, &q->lock);
+	if (q->tail != NULL) q->tail->next = job;
+	else q->head = job;
+	q->tail = job;
+	q->pending++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * 同时遍历主机目录src和映像中的目录dir(分区内路径为path，完整路径为dst)
+ * 主机上的每个文件在映像中查找并比较大小，大小相同的交给工作线程比较内容，
+ * 再遍历映像目录找出主机上没有的文件，映像只在当前线程访问
+ */
+static void verify_dir(struct verify_queue *q, partition_t *part, struct fnode *dir, char *src, char *path,
+					   char *dst) {
+	struct fs_dirent *ent = malloc(sizeof(struct fs_dirent));
+	struct verify_job *job;
+	struct fnode *fnode;
+	struct dirent *ptr;
+	struct stat st;
+	char *from, *sub, *to;
+	void *handle;
+	DIR *d;
+
+	d = opendir(src);
+	if (d == NULL) {
+		verify_report(q, "Open dir %s failed!\n", src);
+		free(ent);
+		return;
+	}
+	while ((ptr = readdir(d)) != NULL) {
+		char *filename = FILE_NAME(ptr);
+		if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) continue;
+
+		from = malloc(strlen(src) + strlen(filename) + 2);
+		sub	 = malloc(strlen(path) + strlen(filename) + 2);
+		to	 = malloc(strlen(dst) + strlen(filename) + 2);
+		sprintf(from, "%s/%s", src, filename);
+		sprintf(sub, "%s/%s", path, filename);
+		sprintf(to, "%s/%s", dst, filename);
+		if (FILE_ATTR(ptr) & FILE_ATTR_DIR) {
+			fnode = part->fsi->opendir(q->ffi, q->fp, part, sub);
+			if (fnode == NULL) verify_report(q, "Missing in image: %s/\n", to);
+			else verify_dir(q, part, fnode, from, sub, to);
+		} else if ((FILE_ATTR(ptr) & FILE_ATTR_FILE) && stat(from, &st) == 0) {
+			fnode = part->fsi->open(q->ffi, q->fp, part, dir, filename);
+			if (fnode == NULL) {
+				verify_report(q, "Missing in image: %s\n", to);
+			} else if (fnode->size != (uint64_t)st.st_size) {
+				verify_report(q, "Size differs: %s\n", to);
+			} else {
+				job		  = calloc(1, sizeof(struct verify_job));
+				job->src  = strdup(from);
+				job->path = strdup(to);
+				job->size = fnode->size;
+				job->nrun = part->fsi->get_runs(q->ffi, q->fp, fnode, &job->runs);
+				verify_push(q, job);
+			}
+			if (fnode != NULL) part->fsi->close(q->ffi, q->fp, fnode);
+		}
+		free(from);
+		free(sub);
+		free(to);
+	}
+	closedir(d);
+
+	handle = part->fsi->diropen(q->ffi, q->fp, dir);
+	while (part->fsi->readdir(q->ffi, q->fp, handle, ent)) {
+		from = malloc(strlen(src) + strlen(ent->name) + 2);
+		sprintf(from, "%s/%s", src, ent->name);
+		if (stat(from, &st) != 0) {
+			to = malloc(strlen(dst) + strlen(ent->name) + 2);
+			sprintf(to, "%s/%s", dst, ent->name);
+			verify_report(q, ent->is_dir ? "Only in image: %s/\n" : "Only in image: %s\n", to);
+			free(to);
+		} else if (!ent->is_dir != !S_ISDIR(st.st_mode)) {
+			verify_report(q, "Type differs: %s\n", from);
+		}
+		free(from);
+	}
+	part->fsi->dirclose(handle);
+	free(ent);
+}
+
+/**
+ * 校验映像中的目录dst和主机目录src的内容是否一致，jobs个线程并行读取和比较文件内容
+ * 报告缺少的文件、大小或内容不同的文件，全部一致时返回0
+ */
+int verify_dir_parallel(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst, int jobs) {
+	struct verify_queue q;
+	pthread_t *workers;
+	partition_t *part;
+	struct fnode *dir;
+	int i, p, len;
+
+	part = get_part(dst, pt, &p);
+	if (part == NULL) {
+		printf("Unknown path  \"%s\"!\n", dst);
+		return -1;
+	}
+	dir = part->fsi->opendir(ffi, fp, part, dst + p);
+	if (dir == NULL) {
+		printf("Can't find directory \"%s\"\n", dst);
+		return -1;
+	}
+	memset(&q, 0, sizeof(q));
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.cond, NULL);
+	q.ffi	= ffi;
+	q.fp	= fp;
+	workers = malloc(jobs * sizeof(pthread_t));
+	for (i = 0; i < jobs; i++)
+		pthread_create(&workers[i], NULL, verify_worker_thread, &q);
+
+	// 报告中的路径不带末尾的'/'
+	src = strdup(src);
+	dst = strdup(dst);
+	for (len = strlen(src); len > 1 && src[len - 1] == '/'; len--)
+		src[len - 1] = 0;
+	for (len = strlen(dst); len > 1 && dst[len - 1] == '/'; len--)
+		dst[len - 1] = 0;
+	verify_dir(&q, part, dir, src, dst + p, dst);
+	free(src);
+	free(dst);
+
+	pthread_mutex_lock(&q.lock);
+	q.done = 1;
+	pthread_cond_broadcast(&q.cond);
+	pthread_mutex_unlock(&q.lock);
+	for (i = 0; i < jobs; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	pthread_cond_destroy(&q.cond);
+	pthread_mutex_destroy(&q.lock);
+	printf("Verified %u files, %llu bytes, %u problems\n", q.files, (unsigned long long)q.bytes, q.problems);
+	return q.problems == 0 ? 0 : -1;
+}
+
+#else
+
+// 其他系统上退回到逐个文件复制
+int copy_dir_parallel(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst, int jobs, int flags) {
+	return copy_dir(pt, ffi, fp, src, dst, flags);
+}
+
+int verify_dir_parallel(partition_t *pt[4], struct ffi *ffi, FILE *fp, char *src, char *dst, int jobs) {
+	printf("Unsupport this Operating System!\n");
+	return -1;
+}
+
+#endif
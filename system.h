@@ -7,6 +7,8 @@
 #define FILE_ATTR_DIR  (DT_DIR)
 #define FILE_ATTR_FILE (DT_REG)
 
+#define HOST_MKDIR(path) mkdir(path, 0755)
+
 #elif _WIN32
 
 #include <Windows.h>
@@ -17,4 +19,6 @@
 #define FILE_ATTR_DIR  (FILE_ATTRIBUTE_DIRECTORY)
 #define FILE_ATTR_FILE (FILE_ATTRIBUTE_ARCHIVE)
 
+#define HOST_MKDIR(path) (CreateDirectory(path, NULL) ? 0 : -1)
+
 #endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+#!/bin/sh
+# 检查64位偏移，每种后端都写入、校验、导出并逐字节比较，最后检查分区的一致性：
+# 1. 40GiB的映像中一个跨过4GiB的文件和一个从32GiB之后开始的文件
+# 2. 分区从36GiB开始的映像，分区中的所有偏移都超过32位
+# 用法: tests/large_offsets.sh [imgtool路径]，映像是稀疏的，实际只占用几十MB
+set -e
+
+IMGTOOL=${1:-./imgtool}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+IMG=$DIR/large.img
+PART=1048576 # mkfs创建的分区从1MiB开始
+CLUS=32768
+GIB=$((1024 * 1024 * 1024))
+
+fail() {
+	echo "FAIL: $*"
+	exit 1
+}
+
+# 读取映像中offset处的小端整数，size为字节数
+read_le() {
+	od -An -tu"$3" -j "$2" -N "$3" "$1" | tr -d ' '
+}
+
+# 在映像中offset处写入4字节的小端整数
+write_le32() {
+	printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $(($3 & 255)) $(($3 >> 8 & 255)) $(($3 >> 16 & 255)) $(($3 >> 24)))" |
+		dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+# 第clus个簇在映像中的字节偏移
+clus_offset() {
+	echo $((PART + (RSVD + FATS * FATSZ) * 512 + ($1 - 2) * CLUS))
+}
+
+first_clus() {
+	"$IMGTOOL" "$IMG" stat "/p0/$1" | sed -n 's/.*first block \([0-9]*\).*/\1/p'
+}
+
+# 修改FSInfo中的下一个空闲簇，之后创建的文件从这个簇开始分配
+copy_at() {
+	write_le32 "$IMG" $((PART + 512 + 492)) $2
+	"$IMGTOOL" -b $backend "$IMG" copy "$DIR/src/$1" /p0/ >/dev/null || fail "$backend: copy $1"
+	[ "$(first_clus $1)" = $2 ] || fail "$backend: $1 not at cluster $2"
+}
+
+# 校验映像中的文件，导出后与源文件逐字节比较
+compare() {
+	rm -rf "$DIR/out"
+	mkdir "$DIR/out"
+	"$IMGTOOL" -b $backend "$IMG" verify "$DIR/src/" /p0/ | grep -q ", 0 problems" || fail "$backend: verify"
+	"$IMGTOOL" -b $backend "$IMG" extract /p0/ "$DIR/out/" >/dev/null || fail "$backend: extract"
+	for f in "$DIR"/src/*; do
+		cmp "$f" "$DIR/out/${f##*/}" || fail "$backend: ${f##*/} differs"
+	done
+	"$IMGTOOL" "$IMG" check /p0/ >/dev/null || fail "$backend: check"
+}
+
+mkdir "$DIR/src"
+head -c $((16 * 1024 * 1024)) /dev/urandom >"$DIR/src/at4g.bin"
+head -c $((16 * 1024 * 1024 + 1234)) /dev/urandom >"$DIR/src/past32g.bin"
+
+for backend in raw mmap uring; do
+	rm -f "$IMG"
+	"$IMGTOOL" "$IMG" mkfs 40G 32K >/dev/null || fail "mkfs"
+	RSVD=$(read_le "$IMG" $((PART + 14)) 2)
+	FATS=$(read_le "$IMG" $((PART + 16)) 1)
+	FATSZ=$(read_le "$IMG" $((PART + 36)) 4)
+
+	# 从4GiB之前8MiB开始，跨过4GiB
+	start=$(((4 * GIB - 8 * 1024 * 1024 - $(clus_offset 2)) / CLUS + 2))
+	copy_at at4g.bin $start
+	start=$(((32 * GIB - $(clus_offset 2)) / CLUS + 100))
+	copy_at past32g.bin $start
+	[ $(clus_offset $start) -gt $((32 * GIB)) ] || fail "past32g.bin starts before 32GiB"
+	compare
+	echo "$backend: files past 4GiB and 32GiB ok"
+done
+
+# 把8GiB映像中的分区元数据搬到36GiB处，再修改分区表中的起始扇区
+rm -f "$DIR/small.img"
+"$IMGTOOL" "$DIR/small.img" mkfs 8G 32K >/dev/null || fail "mkfs"
+for backend in raw mmap uring; do
+	rm -f "$IMG"
+	truncate -s 48G "$IMG"
+	dd if="$DIR/small.img" of="$IMG" bs=512 count=1 conv=notrunc 2>/dev/null
+	dd if="$DIR/small.img" of="$IMG" bs=1M skip=1 seek=$((36 * 1024)) count=8 conv=notrunc 2>/dev/null
+	write_le32 "$IMG" $((0x1be + 8)) $((36 * GIB / 512))
+	for f in "$DIR"/src/*; do
+		"$IMGTOOL" -b $backend "$IMG" copy "$f" /p0/ >/dev/null || fail "$backend: copy ${f##*/}"
+	done
+	compare
+	echo "$backend: partition at 36GiB ok"
+done